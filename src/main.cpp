@@ -5,6 +5,8 @@
 #include <string>
 #include <string_view>
 #include <chrono>
+#include <vector>
+#include <algorithm>
 
 
 #define PHOENIX_MAIN
@@ -15,11 +17,20 @@
 using namespace Phoenix;
 
 
+std::vector<SoundHandle> songs; // Loaded songs, in load order
+
+SoundHandle getSong(SoundManager& sm, uint32_t id, SP_Sound& mySound) {
+	if (id >= songs.size())
+		return SoundHandle();
+	mySound = sm.getSound(songs[id]);
+	return songs[id];
+}
+
 void playSound(SoundManager &sm, uint32_t id) {
 	SP_Sound mySound;
-	mySound = sm.getSoundbyID(id);
+	SoundHandle handle = getSong(sm, id, mySound);
 	if (mySound) {
-		if (!mySound->playSound())
+		if (!sm.playSound(handle))
 			printf("\nError playing Sound %d", id);
 		printf("\nPlaying Sound %d - %s", id, mySound->filePath.c_str());
 	}
@@ -27,9 +38,9 @@ void playSound(SoundManager &sm, uint32_t id) {
 
 void restartSound(SoundManager& sm, uint32_t id) {
 	SP_Sound mySound;
-	mySound = sm.getSoundbyID(id);
+	SoundHandle handle = getSong(sm, id, mySound);
 	if (mySound) {
-		if (!mySound->restartSound())
+		if (!sm.restartSound(handle))
 			printf("\nError restarting Sound %d", id);
 		printf("\nRestarted Sound %d - %s", id, mySound->filePath.c_str());
 	}
@@ -37,9 +48,9 @@ void restartSound(SoundManager& sm, uint32_t id) {
 
 void stopSound(SoundManager& sm, uint32_t id) {
 	SP_Sound mySound;
-	mySound = sm.getSoundbyID(id);
+	SoundHandle handle = getSong(sm, id, mySound);
 	if (mySound) {
-		if (!mySound->stopSound())
+		if (!sm.stopSound(handle))
 			printf("\nError stopping Sound %d", id);
 		printf("\nStopped Sound %d - %s", id, mySound->filePath.c_str());
 	}
@@ -47,22 +58,51 @@ void stopSound(SoundManager& sm, uint32_t id) {
 
 void seekSound(SoundManager& sm, uint32_t id, float second) {
 	SP_Sound mySound;
-	mySound = sm.getSoundbyID(id);
+	SoundHandle handle = getSong(sm, id, mySound);
 	if (mySound) {
-		mySound->seekSound(second);
+		sm.seekSound(handle, second);
 		printf("\nMoving to second %.2f on Sound %d - %s", second, id, mySound->filePath.c_str());
 	}
 }
 
 void setSoundVolume(SoundManager& sm, uint32_t id, float volume) {
 	SP_Sound mySound;
-	mySound = sm.getSoundbyID(id);
+	SoundHandle handle = getSong(sm, id, mySound);
 	if (mySound) {
-		mySound->volume = volume;
+		sm.setSoundVolume(handle, volume);
 		printf("\nSet volume %.2f on Sound %d - %s", volume, id, mySound->filePath.c_str());
 	}
 }
 
+void loadSound(SoundManager& sm, const std::string_view filePath) {
+	SoundHandle handle = sm.addSound(filePath);
+	if (!handle.isValid())
+		printf("\nError loading Song %s", filePath.data());
+	else {
+		if (std::find(songs.begin(), songs.end(), handle) == songs.end())
+			songs.push_back(handle);
+		printf("\nLoaded Song %s in slot %d", filePath.data(), static_cast<int>(std::find(songs.begin(), songs.end(), handle) - songs.begin()));
+	}
+}
+
+void preloadManifest(SoundManager& sm, const std::string_view manifestFile) {
+	std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+	std::vector<SoundFuture> sounds = sm.preloadManifest(manifestFile, [](uint32_t loaded, uint32_t total, const std::string& filePath, bool ok) {
+		printf("\n[%u/%u] %s %s", loaded, total, ok ? "Loaded" : "Error loading", filePath.c_str());
+	});
+	sm.waitLoads();
+
+	for (auto const& sound : sounds) {
+		SoundHandle handle = sound.get();
+		if (handle.isValid() && std::find(songs.begin(), songs.end(), handle) == songs.end())
+			songs.push_back(handle);
+	}
+
+	std::chrono::duration<float> load_time = std::chrono::steady_clock::now() - start_time;
+	printf("\nPreloaded %u songs in %.3f seconds", static_cast<uint32_t>(sounds.size()), load_time.count());
+}
+
 void fftAnalysis(SoundManager& sm) {
 			
 	std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
@@ -74,6 +114,8 @@ void fftAnalysis(SoundManager& sm) {
 		std::chrono::duration<float> frame_time = start_time - end_time;
 
 		sm.performFFT(frame_time.count());
+		if (sm.updateLatency())
+			printf("\nLatency changed: %.1f ms", sm.getLatencyInfo().totalMs);
 
 		end_time = std::chrono::steady_clock::now();
 
@@ -89,33 +131,68 @@ void fftAnalysis(SoundManager& sm) {
 
 			float value = 0;
 			for (uint32_t j = 0; j < bars; j++) {
-				value += sm.m_pFFTBuffer[i * bars + j]; // we accumulate values for the same bar
+				value += sm.getOutputAnalyzer()->m_pFFTBuffer[i * bars + j]; // we accumulate values for the same bar
 			}
 			printf("%.1f ", value); // Print the value of the block
 		}
 		*/
 
 		// L/M/H value frequencies
-		//printf("%.1f - %.1f - %.1f", sm.m_lowFreqSum, sm.m_midFreqSum, sm.m_highFreqSum); // Print the value of the Frequencies analyzed
+		//printf("%.1f - %.1f - %.1f", sm.getOutputAnalyzer()->m_fLowFreqSum, sm.getOutputAnalyzer()->m_fMidFreqSum, sm.getOutputAnalyzer()->m_fHighFreqSum); // Print the value of the Frequencies analyzed
 
 		// Beat detection
-		printf("Beat: %.5f", sm.m_fBeat); // Print the beat value
+		if (sm.getOutputAnalyzer()) {
+			printf("Output beat: %.5f ", sm.getOutputAnalyzer()->m_fBeat); // Print the beat value of our mix
+			printf("Kick: %.5f Hi-hat: %.5f ", sm.getOutputAnalyzer()->getBinMagnitude(0), sm.getOutputAnalyzer()->getBinMagnitude(1)); // Tracked bins
+		}
+		if (sm.getInputAnalyzer())
+			printf("Input beat: %.5f", sm.getInputAnalyzer()->m_fBeat); // Print the beat value of the capture device
 	}
 }
 
 
 int main(int argc, char* argv[])
 {
-	SoundManager soundManager;
+	// Device mode: "-capture" analyzes the line-in, "-duplex" plays our songs and analyzes both the mix and the line-in
+	// "-adaptive" adjusts the device buffer at runtime, from the detected xruns
+	SoundDeviceConfig deviceConfig;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-capture") == 0) {
+			deviceConfig.mode = DeviceMode::Capture;
+			deviceConfig.analysis = AnalysisSource::Input;
+			deviceConfig.latency = LatencyMode::LowLatency;
+		}
+		else if (strcmp(argv[i], "-duplex") == 0) {
+			deviceConfig.mode = DeviceMode::Duplex;
+			deviceConfig.analysis = AnalysisSource::Both;
+			deviceConfig.latency = LatencyMode::LowLatency;
+		}
+		else if (strcmp(argv[i], "-adaptive") == 0) {
+			deviceConfig.adaptiveLatency = true;
+		}
+	}
+
+	SoundManager soundManager(deviceConfig);
 
 	char charCaptured = 0;
 	printf("\nMiniaudio version: %s\n", soundManager.getVersion().c_str());
 
+	// Track a kick and a hi-hat frequency, without the full FFT
+	if (soundManager.getOutputAnalyzer())
+		soundManager.getOutputAnalyzer()->setupBinTracker({ 60.0f, 8000.0f });
+
+	soundManager.setDeviceListCallback([]() { printf("\nDevice list changed"); });
 	soundManager.enumerateDevices();
 
+	// Sounds are loaded from the pack when available (build it with: packbuilder files/sounds.pak -manifest files/manifest.txt)
+	if (soundManager.openPack("files/sounds.pak"))
+		printf("\nUsing sound pack: files/sounds.pak\n");
+	int32_t playbackDevice = -1;
+
 	printf("\nPress 'z' to quit...\n");
 	printf("\n1-Load song: \"piano.mp3\"");
 	printf("\n2-Load song: \"1-20kHz.wav\"");
+	printf("\n3-Preload all the songs in \"manifest.txt\"");
 	printf("\nq-Play song 0");
 	printf("\nw-Play song 1");
 	printf("\na-Stop song 0");
@@ -135,6 +212,9 @@ int main(int argc, char* argv[])
 
 	printf("\n7- Show FFT analysis");
 
+	printf("\n\nd-Switch to next playback device");
+	printf("\nl-Show device latency");
+
 	printf("\n\np-Clear all songs from memory");
 	
 	printf("\n\nChoose wisely!!!!\n");
@@ -145,21 +225,14 @@ int main(int argc, char* argv[])
 		charCaptured = getchar();
 		switch (charCaptured) {
 		case '1':
-			if (!soundManager.addSound("files/music.mp3"))
-				printf("\nError loading Song");
-			else {
-				int slot = static_cast<int>(soundManager.sound.size()) - 1;
-				printf("\nLoaded Song %s in slot %d", soundManager.sound[slot]->filePath.c_str(), slot);
-			}
+			loadSound(soundManager, "files/music.mp3");
 				
 			break;
 		case '2':
-			if (!soundManager.addSound("files/1-20kHz.wav"))
-				printf("\nError loading Song");
-			else {
-				int slot = static_cast<int>(soundManager.sound.size()) - 1;
-				printf("\nLoaded Song %s in slot %d", soundManager.sound[slot]->filePath.c_str(), slot);
-			}
+			loadSound(soundManager, "files/1-20kHz.wav");
+			break;
+		case '3':
+			preloadManifest(soundManager, "files/manifest.txt");
 			break;
 		case 'q':
 			playSound(soundManager, 0);
@@ -190,6 +263,27 @@ int main(int argc, char* argv[])
 			fftAnalysis(soundManager);
 			break;
 
+		case 'd': {
+			soundManager.refreshDevices();
+			const std::vector<ma_device_info>& devices = soundManager.getPlaybackDevices();
+			playbackDevice++;
+			if (playbackDevice >= static_cast<int32_t>(devices.size()))
+				playbackDevice = 0;
+			std::string deviceName = devices.empty() ? "" : devices[playbackDevice].name;	// The list may be refreshed by the switch
+			if (soundManager.switchDevice(playbackDevice, -1))
+				printf("\nSwitched to device %d - %s", playbackDevice, deviceName.c_str());
+			else
+				printf("\nError switching to device %d", playbackDevice);
+			break;
+		}
+
+		case 'l': {
+			SoundLatencyInfo latency = soundManager.getLatencyInfo();
+			printf("\nPeriod: %u frames x %u, playback: %.1f ms, capture: %.1f ms, total: %.1f ms, xruns: %u",
+				latency.periodSizeInFrames, latency.periods, latency.playbackMs, latency.captureMs, latency.totalMs, latency.xruns);
+			break;
+		}
+
 		// Master volume
 		case '8':
 			if (soundManager.setMasterVolume(0.0f))
@@ -219,6 +313,7 @@ int main(int argc, char* argv[])
 		case 'p':
 			printf("\nCleared all songs");
 			soundManager.clearSounds();
+			songs.clear();
 			break;
 
 		case 'z':
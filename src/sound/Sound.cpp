@@ -9,9 +9,10 @@ namespace Phoenix {
 	Sound::Sound()
 		:
 		m_pDecoder(nullptr),
+		m_pAudioBuffer(nullptr),
+		m_fromPack(false),
 		filePath(""),
-		status(State::NotReady),
-		volume (1.0)
+		status(State::NotReady)
 	{
 	}
 
@@ -27,10 +28,18 @@ namespace Phoenix {
 			free(m_pDecoder);
 			m_pDecoder = nullptr;
 		}
+		if (m_pAudioBuffer) {
+			ma_audio_buffer_uninit(m_pAudioBuffer);
+			free(m_pAudioBuffer);
+			m_pAudioBuffer = nullptr;
+		}
+		m_PCMData.clear();
+		m_PCMData.shrink_to_fit();
+		m_fromPack = false;
 		status = State::NotReady;
 	}
 
-	bool Sound::loadSoundFile(const std::string_view soundFile, uint32_t channels, uint32_t sampleRate)
+	bool Sound::loadSoundFile(const std::string_view soundFile, uint32_t channels, uint32_t sampleRate, const SoundLoadConfig& config)
 	{
 		ma_result result;
 
@@ -39,6 +48,19 @@ namespace Phoenix {
 			unLoadSong();
 		}
 		filePath = soundFile;
+
+		// Convert the sound once to the device format, so playback never needs to resample
+		if (config.preDecode) {
+			// The hash is only the cache key, don't read every byte twice when there is no cache
+			std::vector<uint8_t> fileData;
+			if (SoundConverter::readFile(soundFile, fileData) &&
+				convertPCM(fileData.data(), fileData.size(), config.cachePath.empty() ? 0 : SoundConverter::hash(fileData.data(), fileData.size()), channels, sampleRate, config)) {
+				status = State::Stopped;
+				return true;
+			}
+			unLoadSong();
+			filePath = soundFile;
+		}
 		
 		// Allocate space for structure
 		m_pDecoder = (ma_decoder*)malloc(sizeof(ma_decoder));
@@ -46,6 +68,7 @@ namespace Phoenix {
 		// Init de Decoder and load song
 		ma_decoder_config decoderConfig;
 		decoderConfig = ma_decoder_config_init(ma_format_f32, channels, sampleRate);
+		decoderConfig.seekPointCount = config.seekPointCount;	// Built now, so seeking during playback is fast
 		result = ma_decoder_init_file(soundFile.data(), &decoderConfig, m_pDecoder);
 		if (result != MA_SUCCESS) {
 			unLoadSong();
@@ -56,51 +79,97 @@ namespace Phoenix {
 		return true;
 	}
 
-	bool Sound::playSound()
+	bool Sound::loadSoundAsset(const SoundPackAsset& asset, uint32_t channels, uint32_t sampleRate, const SoundLoadConfig& config)
 	{
+		// If song is already loaded, we unload it first
 		if (status != State::NotReady) {
-			status = State::Playing;
-			return true;
+			unLoadSong();
 		}
-		else
-			return false;
+		filePath = asset.name;
+
+		// PCM already in the device format: play it straight from the mapped pack
+		bool ok = false;
+		if (asset.pPCM && asset.pcmChannels == channels && asset.pcmSampleRate == sampleRate)
+			ok = initAudioBuffer(asset.pPCM, asset.pcmFrames, channels, sampleRate);
+		else if (config.preDecode)
+			ok = convertPCM(asset.pData, asset.dataSize, asset.dataHash, channels, sampleRate, config);
+
+		// Otherwise decode from the mapped bytes while playing
+		if (!ok) {
+			m_pDecoder = (ma_decoder*)malloc(sizeof(ma_decoder));
+			ma_decoder_config decoderConfig;
+			decoderConfig = ma_decoder_config_init(ma_format_f32, channels, sampleRate);
+			decoderConfig.seekPointCount = config.seekPointCount;
+			if (ma_decoder_init_memory(asset.pData, asset.dataSize, &decoderConfig, m_pDecoder) != MA_SUCCESS) {
+				unLoadSong();
+				return false;
+			}
+		}
+
+		m_fromPack = true;
+		m_asset = asset;
+		status = State::Stopped;
+		return true;
 	}
 
-	bool Sound::stopSound()
+	bool Sound::reloadSoundFile(uint32_t channels, uint32_t sampleRate, const SoundLoadConfig& config)
 	{
-		if (status != State::NotReady) {
-			status = State::Stopped;
-			return true;
-		}
-		else
+		return loadSoundFrom(*this, channels, sampleRate, config);
+	}
+
+	bool Sound::loadSoundFrom(const Sound& source, uint32_t channels, uint32_t sampleRate, const SoundLoadConfig& config)
+	{
+		if (source.status == State::NotReady)
 			return false;
+
+		// Copy the origin first, source may be this same sound
+		if (source.m_fromPack) {
+			SoundPackAsset asset = source.m_asset;
+			return loadSoundAsset(asset, channels, sampleRate, config);
+		}
+
+		std::string soundFile = source.filePath;
+		return loadSoundFile(soundFile, channels, sampleRate, config);
 	}
 
-	bool Sound::restartSound()
+	bool Sound::convertPCM(const void* pData, size_t dataSize, uint64_t dataHash, uint32_t channels, uint32_t sampleRate, const SoundLoadConfig& config)
 	{
-		ma_result result;
-		if (status != State::NotReady) {
-			result = ma_decoder_seek_to_pcm_frame(m_pDecoder, 0);
-			if (result != MA_SUCCESS) {
+		// Try the disk cache first, then convert and store the result for the next run
+		std::string cacheFile = SoundConverter::getCacheFile(config, dataHash, channels, sampleRate);
+		if (!SoundConverter::loadCache(cacheFile, channels, sampleRate, m_PCMData)) {
+			if (!SoundConverter::convertToPCM(pData, dataSize, channels, sampleRate, config, m_PCMData))
 				return false;
-			}
+			SoundConverter::saveCache(cacheFile, channels, sampleRate, m_PCMData);
 		}
-		else
-			return false;
 
-		return true;
+		return initAudioBuffer(m_PCMData.data(), m_PCMData.size() / channels, channels, sampleRate);
 	}
 
-	void Sound::seekSound(float second)
+	bool Sound::initAudioBuffer(const float* pPCM, uint64_t frames, uint32_t channels, uint32_t sampleRate)
 	{
-		if (status != State::NotReady) {
-			float myFFrame = static_cast<float>(m_pDecoder->outputSampleRate) * second;
-			uint64_t myFrame = static_cast<uint64_t>(myFFrame);
-			ma_decoder_seek_to_pcm_frame(m_pDecoder, myFrame);
+		// The audio buffer references the PCM data, no copy is made
+		m_pAudioBuffer = (ma_audio_buffer*)malloc(sizeof(ma_audio_buffer));
+		ma_audio_buffer_config bufferConfig;
+		bufferConfig = ma_audio_buffer_config_init(ma_format_f32, channels, frames, pPCM, NULL);
+		bufferConfig.sampleRate = sampleRate;
+		if (ma_audio_buffer_init(&bufferConfig, m_pAudioBuffer) != MA_SUCCESS) {
+			free(m_pAudioBuffer);
+			m_pAudioBuffer = nullptr;
+			return false;
 		}
+
+		return true;
 	}
+
 	ma_decoder* Sound::getDecoder()
 	{
 		return m_pDecoder;
 	}
+
+	ma_data_source* Sound::getDataSource()
+	{
+		if (m_pAudioBuffer)
+			return m_pAudioBuffer;
+		return m_pDecoder;
+	}
 }
\ No newline at end of file
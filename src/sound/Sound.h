@@ -9,6 +9,10 @@
 #include <memory>
 #include <string>
 #include <string_view>
+#include <vector>
+
+#include "sound/SoundConverter.h"
+#include "sound/SoundPack.h"
 
 namespace Phoenix {
 
@@ -31,23 +35,28 @@ namespace Phoenix {
 		virtual ~Sound();
 
 	public:
-		bool loadSoundFile(const std::string_view soundFile, uint32_t channels, uint32_t sampleRate); // Load sound from file
-		bool playSound(); // Play Sound
-		bool stopSound(); // Stop sound
-		bool restartSound(); // Restart sound
-		void seekSound(float second); // Seek sound
+		bool loadSoundFile(const std::string_view soundFile, uint32_t channels, uint32_t sampleRate, const SoundLoadConfig& config); // Load sound from file
+		bool loadSoundAsset(const SoundPackAsset& asset, uint32_t channels, uint32_t sampleRate, const SoundLoadConfig& config); // Load sound from a pack, the pack must stay open while the sound is loaded
+		bool reloadSoundFile(uint32_t channels, uint32_t sampleRate, const SoundLoadConfig& config); // Reload to a new format
+		bool loadSoundFrom(const Sound& source, uint32_t channels, uint32_t sampleRate, const SoundLoadConfig& config); // Load the same file or pack asset as another sound, in a new format
 		ma_decoder* getDecoder();
+		ma_data_source* getDataSource();	// Pre-decoded buffer if available, decoder otherwise
 
 	private:
 		void unLoadSong();	// Unload song
+		bool convertPCM(const void* pData, size_t dataSize, uint64_t dataHash, uint32_t channels, uint32_t sampleRate, const SoundLoadConfig& config);
+		bool initAudioBuffer(const float* pPCM, uint64_t frames, uint32_t channels, uint32_t sampleRate);
 
 	public:
 		std::string		filePath;		// file path
-		Sound::State	status;			// Sound status
-		float			volume;			// Sound volume (0.0 to 1.0)
+		Sound::State	status;			// Load status (NotReady or Stopped), the playback state lives in the SoundManager voices
 
 	private:
-		ma_decoder		*m_pDecoder;	// Internal miniaudio decoder
+		ma_decoder		*m_pDecoder;	// Internal miniaudio decoder (used when the sound is not pre-decoded)
+		ma_audio_buffer	*m_pAudioBuffer;// Buffer over the pre-decoded PCM data
+		std::vector<float>	m_PCMData;	// Pre-decoded PCM data, already in the device format (empty if the PCM comes from a pack)
+		bool			m_fromPack;		// Loaded from m_asset instead of a file
+		SoundPackAsset	m_asset;		// Pack data, used to reload the sound
 
 	};
 }
\ No newline at end of file
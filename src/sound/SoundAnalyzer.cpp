@@ -0,0 +1,397 @@
+// SoundAnalyzer.cpp
+// Spontz Demogroup
+
+#include "main.h"
+#include "sound/SoundAnalyzer.h"
+
+namespace Phoenix {
+
+	SoundAnalyzer::SoundAnalyzer(uint32_t sampleRate)
+		:
+		m_pSampleBuf(nullptr),
+		m_pFFTInput(nullptr),
+		m_pBinTracker(nullptr),
+		m_pEnergy(nullptr),
+		m_pFFTFrequencies(nullptr),
+		m_pFFTBuffer(nullptr),
+		m_pSpectrogram(nullptr),
+		m_pSpectrogramRow(nullptr),
+		m_pBandBins(nullptr),
+		m_sampleRate(sampleRate)
+	{
+		// Sample buffer
+		m_pSampleBuf = (float*)malloc(sizeof(float) * FFT_SIZE * 2);
+		if (m_pSampleBuf != nullptr)
+			memset(m_pSampleBuf, 0, sizeof(float) * FFT_SIZE * 2);
+
+		m_pFFTInput = (float*)malloc(sizeof(float) * FFT_SIZE * 2);
+		if (m_pFFTInput != nullptr)
+			memset(m_pFFTInput, 0, sizeof(float) * FFT_SIZE * 2);
+
+		// FFT config
+		m_fftcfg = kiss_fftr_alloc(FFT_SIZE * 2, false, NULL, NULL);
+
+		// FFT values buffer
+		m_pFFTBuffer = (float*)malloc(sizeof(float) * FFT_SIZE);
+		if (m_pFFTBuffer)
+			memset(m_pFFTBuffer, 0, sizeof(float) * FFT_SIZE);
+
+		// FFT frequencies buffer
+		m_pFFTFrequencies = (float*)malloc(sizeof(float) * FFT_SIZE);
+		setSampleRate(sampleRate);
+
+		// BEAT buffer
+		m_pEnergy = (float*)malloc(sizeof(float) * FFT_SIZE);
+		if (m_pEnergy)
+			memset(m_pEnergy, 0, sizeof(float) * FFT_SIZE);
+	}
+
+	SoundAnalyzer::~SoundAnalyzer()
+	{
+		kiss_fft_free(m_fftcfg);		// Free fft
+
+		// Delete internal buffers
+		if (m_pSampleBuf)
+			free(m_pSampleBuf);
+		if (m_pFFTInput)
+			free(m_pFFTInput);
+		if (m_pFFTBuffer)
+			free(m_pFFTBuffer);
+		if (m_pFFTFrequencies)
+			free(m_pFFTFrequencies);
+		if (m_pEnergy)
+			free(m_pEnergy);
+		freeSpectrogram();
+		if (m_pBinTracker.load())
+			delete m_pBinTracker.load();
+	}
+
+	void SoundAnalyzer::setSampleRate(uint32_t sampleRate)
+	{
+		m_sampleRate = sampleRate;
+		if (m_pBandBins)
+			updateBandBins(); // Band limits depend on the sample rate, the ring is kept: readers may be holding views of it
+		if (!m_binFrequencies.empty())
+			setupBinTracker(std::vector<float>(m_binFrequencies), m_binWindowSize);
+
+		if (m_pFFTFrequencies) {
+			for (int32_t i = 0; i < FFT_SIZE; i++) {
+				m_pFFTFrequencies[i] = static_cast<float>(i) * (sampleRate / 2.0f / FFT_SIZE);
+			}
+		}
+	}
+
+	void SoundAnalyzer::captureSamples(const float* pSamples, uint32_t channels, uint32_t frameCount)
+	{
+		if (pSamples == nullptr || m_pSampleBuf == nullptr || channels == 0)
+			return;
+
+		// Sequentially consistent with the tracker swap, see setupBinTracker()
+		m_captureEpoch.fetch_add(1);
+		SoundBinTracker* pTracker = m_pBinTracker.load();
+
+		const float scale = m_fAmplification / static_cast<float>(channels);
+		uint32_t pos = m_uiWritePos.load(std::memory_order_relaxed);
+		while (frameCount > 0) {
+			// Contiguous segment of the ring
+			uint32_t segment = FFT_SIZE * 2 - pos;
+			if (segment > frameCount)
+				segment = frameCount;
+
+			float* p_sample = m_pSampleBuf + pos;
+			for (uint32_t i = 0; i < segment; i++) {
+				float value = 0;
+				for (uint32_t c = 0; c < channels; c++)
+					value += *(pSamples++);
+				p_sample[i] = value * scale;
+			}
+
+			// The tracker reads the downmixed samples right from the ring
+			if (pTracker)
+				pTracker->processSamples(p_sample, segment);
+
+			frameCount -= segment;
+			pos += segment;
+			if (pos == FFT_SIZE * 2)
+				pos = 0;
+		}
+		m_uiWritePos.store(pos, std::memory_order_release);
+
+		m_captureEpoch.fetch_add(1);
+	}
+
+	bool SoundAnalyzer::performFFT(float frameTime)
+	{
+		// Unroll the capture ring, oldest sample first
+		uint32_t pos = m_uiWritePos.load(std::memory_order_acquire);
+		memcpy(m_pFFTInput, m_pSampleBuf + pos, sizeof(float) * (FFT_SIZE * 2 - pos));
+		memcpy(m_pFFTInput + (FFT_SIZE * 2 - pos), m_pSampleBuf, sizeof(float) * pos);
+
+		kiss_fft_cpx out[FFT_SIZE + 1];			// FFT complex output
+		kiss_fftr(m_fftcfg, m_pFFTInput, out);
+
+
+		m_fLowFreqSum = 0.0f;
+		m_fMidFreqSum = 0.0f;
+		m_fHighFreqSum = 0.0f;
+		m_fBeat = 0.0f;
+
+		for (uint32_t i = 0; i < FFT_SIZE; i++)
+		{
+			// Calculate the FFT buffer
+			static const float scaling = 1.0f / (float)FFT_SIZE;
+			m_pFFTBuffer[i] = 2.0f * sqrtf(out[i].r * out[i].r + out[i].i * out[i].i) * scaling;
+
+			// Calculate the maximum value of the Low, Medium and High frequencies
+			if (m_pFFTFrequencies[i] <= m_lowFreqMax) {
+				m_fLowFreqSum += m_pFFTBuffer[i];
+			}
+			else if (m_pFFTFrequencies[i] <= m_midFreqMax) {
+				m_fMidFreqSum += m_pFFTBuffer[i];
+			}
+			else {
+				m_fHighFreqSum += m_pFFTBuffer[i];
+			}
+		}
+
+		// Calculate the BEAT
+		float instant = 0;	// Instant
+		float avg = 0;		// Average energy
+
+		for (uint32_t i = 0; i < FFT_SIZE; i++)
+			instant += m_pFFTBuffer[i]/2.0f;
+
+		// calculate average energy in last samples
+		for (uint32_t i = 0; i < FFT_SIZE; i++) {
+			avg += m_pEnergy[i];
+		}
+		avg /= (float)m_iPosition;
+
+		// instant sample is a beat?
+		if ((instant / avg) > m_fBeatRatio) {
+			m_fIntensity = 1.0f;
+		}
+		else if (m_fIntensity > 0) {
+			m_fIntensity -= m_fFadeOut * frameTime;
+			if (m_fIntensity < 0) m_fIntensity = 0;
+		}
+
+		// updated kernel shared variable
+		// to be used by kernel itself or another sections
+		m_fBeat += m_fIntensity;
+		if (m_fBeat > 1.0)
+			m_fBeat = 1.0f;
+
+		// update energy buffer
+		if (m_iPosition < FFT_SIZE) {
+			m_pEnergy[m_iPosition - 1] = instant;
+			m_iPosition++;
+		}
+		else {
+			for (uint32_t i = 1; i < FFT_SIZE; i++) {
+				m_pEnergy[i - 1] = m_pEnergy[i];
+			}
+			m_pEnergy[FFT_SIZE - 1] = instant;
+		}
+
+		if (m_pSpectrogram)
+			updateSpectrogram();
+
+		return true;
+	}
+
+	bool SoundAnalyzer::setupSpectrogram(const SpectrogramConfig& config)
+	{
+		freeSpectrogram();
+		if (config.rows < 2 || config.bands > FFT_SIZE || config.maxDB <= config.minDB)
+			return false;
+
+		m_spectrogramConfig = config;
+		m_spectrogramColumns = config.bands ? config.bands : FFT_SIZE;
+		m_spectrogramRowBytes = m_spectrogramColumns * (config.format == SpectrogramFormat::UInt8 ? sizeof(uint8_t) : sizeof(uint16_t));
+
+		m_pSpectrogram = (uint8_t*)malloc(static_cast<size_t>(config.rows) * m_spectrogramRowBytes);
+		m_pSpectrogramRow = (float*)malloc(sizeof(float) * m_spectrogramColumns);
+		if (m_pSpectrogram == nullptr || m_pSpectrogramRow == nullptr) {
+			freeSpectrogram();
+			return false;
+		}
+		memset(m_pSpectrogram, 0, static_cast<size_t>(config.rows) * m_spectrogramRowBytes);
+
+		// Filterbank: log spaced bands from 20Hz to Nyquist, each one with at least one bin
+		if (config.bands) {
+			m_pBandBins = (uint32_t*)malloc(sizeof(uint32_t) * (config.bands + 1));
+			if (m_pBandBins == nullptr) {
+				freeSpectrogram();
+				return false;
+			}
+			updateBandBins();
+		}
+
+		m_spectrogramRowCount.store(0, std::memory_order_release);
+		return true;
+	}
+
+	void SoundAnalyzer::updateBandBins()
+	{
+		const uint32_t bands = m_spectrogramConfig.bands;
+		float binWidth = m_sampleRate / 2.0f / FFT_SIZE;
+		float minFreq = 20.0f;
+		float maxFreq = m_sampleRate / 2.0f;
+		m_pBandBins[0] = 0;
+		for (uint32_t b = 1; b <= bands; b++) {
+			float freq = minFreq * powf(maxFreq / minFreq, static_cast<float>(b) / bands);
+			uint32_t bin = static_cast<uint32_t>(freq / binWidth);
+			if (bin <= m_pBandBins[b - 1])
+				bin = m_pBandBins[b - 1] + 1;
+			m_pBandBins[b] = bin < FFT_SIZE ? bin : FFT_SIZE;
+		}
+		m_pBandBins[bands] = FFT_SIZE;
+	}
+
+	uint32_t SoundAnalyzer::getSpectrogramRows(uint64_t& lastRow, SpectrogramView& view)
+	{
+		view = SpectrogramView();
+		if (m_pSpectrogram == nullptr)
+			return 0;
+
+		uint32_t rows = m_spectrogramConfig.rows;
+		uint64_t count = m_spectrogramRowCount.load(std::memory_order_acquire);
+		if (lastRow > count)
+			lastRow = 0; // The spectrogram has been reset
+
+		// If the reader fell behind more than the ring size, the oldest rows are lost. The slot written next
+		// is never returned: the analysis may be overwriting it while the view is read
+		uint64_t newRows = count - lastRow;
+		if (newRows > rows - 1)
+			newRows = rows - 1;
+		lastRow = count;
+		if (newRows == 0)
+			return 0;
+
+		uint32_t first = static_cast<uint32_t>((count - newRows) % rows);
+		uint32_t firstBlock = rows - first;
+		if (firstBlock > newRows)
+			firstBlock = static_cast<uint32_t>(newRows);
+
+		view.firstRow = first;
+		view.rowBytes = m_spectrogramRowBytes;
+		view.pRows[0] = m_pSpectrogram + static_cast<size_t>(first) * m_spectrogramRowBytes;
+		view.rowCount[0] = firstBlock;
+		if (newRows > firstBlock) {
+			view.pRows[1] = m_pSpectrogram;
+			view.rowCount[1] = static_cast<uint32_t>(newRows) - firstBlock;
+		}
+		return static_cast<uint32_t>(newRows);
+	}
+
+	bool SoundAnalyzer::setupBinTracker(const std::vector<float>& frequencies, uint32_t windowSize)
+	{
+		// Build the new tracker out of the audio thread, then swap it
+		SoundBinTracker* pNewTracker = nullptr;
+		if (!frequencies.empty())
+			pNewTracker = new SoundBinTracker(frequencies, windowSize, m_sampleRate);
+
+		// Swap the pointer, then wait until the audio thread has left any capture that may still use the old tracker
+		SoundBinTracker* pOldTracker = m_pBinTracker.exchange(pNewTracker);
+		if (pOldTracker) {
+			uint64_t epoch = m_captureEpoch.load();
+			if (epoch & 1) {
+				while (m_captureEpoch.load() == epoch)
+					std::this_thread::yield();
+			}
+			delete pOldTracker;
+		}
+
+		m_binFrequencies = frequencies;
+		m_binWindowSize = windowSize;
+		return true;
+	}
+
+	float SoundAnalyzer::getBinMagnitude(uint32_t bin)
+	{
+		SoundBinTracker* pTracker = m_pBinTracker.load(std::memory_order_acquire);
+		return pTracker ? pTracker->getMagnitude(bin) : 0.0f;
+	}
+
+	const uint8_t* SoundAnalyzer::getSpectrogramData()
+	{
+		return m_pSpectrogram;
+	}
+
+	uint64_t SoundAnalyzer::getSpectrogramRowCount()
+	{
+		return m_spectrogramRowCount.load(std::memory_order_acquire);
+	}
+
+	// Float to half float, for values already clamped to 0..1 (no infinites, tiny values are flushed to zero)
+	static inline uint16_t floatToHalf(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xff) - 127 + 15;
+		uint32_t mantissa = bits & 0x7fffff;
+		if (exponent <= 0)
+			return 0;
+		uint32_t half = (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+		return static_cast<uint16_t>(half + ((mantissa >> 12) & 1)); // Round to nearest
+	}
+
+	void SoundAnalyzer::updateSpectrogram()
+	{
+		const uint32_t columns = m_spectrogramColumns;
+		float* pRow = m_pSpectrogramRow;
+
+		// Filterbank reduction, average magnitude of the bins in each band
+		if (m_pBandBins) {
+			for (uint32_t b = 0; b < columns; b++) {
+				float sum = 0;
+				for (uint32_t i = m_pBandBins[b]; i < m_pBandBins[b + 1]; i++)
+					sum += m_pFFTBuffer[i];
+				uint32_t width = m_pBandBins[b + 1] - m_pBandBins[b];
+				pRow[b] = width ? sum / static_cast<float>(width) : 0.0f;
+			}
+		}
+		else {
+			memcpy(pRow, m_pFFTBuffer, sizeof(float) * columns);
+		}
+
+		// Convert to dB and normalize to 0..1, in plain loops over contiguous data so the compiler vectorizes them
+		const float minDB = m_spectrogramConfig.minDB;
+		const float invRange = 1.0f / (m_spectrogramConfig.maxDB - m_spectrogramConfig.minDB);
+		for (uint32_t i = 0; i < columns; i++) {
+			float db = 20.0f * log10f(pRow[i] > 1e-10f ? pRow[i] : 1e-10f);
+			float value = (db - minDB) * invRange;
+			pRow[i] = value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+		}
+
+		// Quantize straight into the ring, then publish the row
+		uint64_t count = m_spectrogramRowCount.load(std::memory_order_relaxed);
+		uint8_t* pDest = m_pSpectrogram + static_cast<size_t>(count % m_spectrogramConfig.rows) * m_spectrogramRowBytes;
+		if (m_spectrogramConfig.format == SpectrogramFormat::UInt8) {
+			for (uint32_t i = 0; i < columns; i++)
+				pDest[i] = static_cast<uint8_t>(pRow[i] * 255.0f + 0.5f);
+		}
+		else {
+			uint16_t* pDest16 = reinterpret_cast<uint16_t*>(pDest);
+			for (uint32_t i = 0; i < columns; i++)
+				pDest16[i] = floatToHalf(pRow[i]);
+		}
+		m_spectrogramRowCount.store(count + 1, std::memory_order_release);
+	}
+
+	void SoundAnalyzer::freeSpectrogram()
+	{
+		if (m_pSpectrogram)
+			free(m_pSpectrogram);
+		if (m_pSpectrogramRow)
+			free(m_pSpectrogramRow);
+		if (m_pBandBins)
+			free(m_pBandBins);
+		m_pSpectrogram = nullptr;
+		m_pSpectrogramRow = nullptr;
+		m_pBandBins = nullptr;
+		m_spectrogramColumns = 0;
+		m_spectrogramRowBytes = 0;
+	}
+}
@@ -0,0 +1,116 @@
+// SoundAnalyzer.h
+// Spontz Demogroup
+
+#pragma once
+
+#include "main.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <kiss_fft.h>
+#include <kiss_fftr.h>
+
+#include "sound/SoundBinTracker.h"
+
+namespace Phoenix {
+
+	#define FFT_SIZE 1024
+
+	// Sample format of the spectrogram rows
+	enum class SpectrogramFormat {
+		UInt8 = 0,		// 0 to 255
+		Float16,		// Half float, 0.0 to 1.0
+	};
+
+	struct SpectrogramConfig {
+		uint32_t			rows = 256;						// History size, in spectra (at least 2, a read returns up to rows - 1)
+		uint32_t			bands = 0;						// Log spaced filterbank bands per row (0: keep the FFT_SIZE bins)
+		SpectrogramFormat	format = SpectrogramFormat::UInt8;
+		float				minDB = -90.0f;					// Level mapped to 0
+		float				maxDB = 0.0f;					// Level mapped to the maximum value
+	};
+
+	// Rows of the spectrogram ring, without copies: the rows may be split in two blocks when the ring wraps around
+	struct SpectrogramView {
+		const uint8_t*	pRows[2] = { nullptr, nullptr };	// First row of each block
+		uint32_t		rowCount[2] = { 0, 0 };				// Rows in each block
+		uint32_t		firstRow = 0;						// Ring row of pRows[0], to update only these rows of a texture
+		uint32_t		rowBytes = 0;
+	};
+
+	// FFT and beat analysis of one audio source (our output mix or a capture device)
+	class SoundAnalyzer final {
+
+	public:
+		SoundAnalyzer(uint32_t sampleRate);
+		~SoundAnalyzer();
+
+	public:
+		void captureSamples(const float* pSamples, uint32_t channels, uint32_t frameCount); // Called from the audio thread: downmix the frames straight into the capture ring
+		bool performFFT(float frameTime);
+		void setSampleRate(uint32_t sampleRate);
+
+		// Spectrogram history, the spectra are converted once per FFT and can be read by any thread
+		bool setupSpectrogram(const SpectrogramConfig& config);
+		uint32_t getSpectrogramRows(uint64_t& lastRow, SpectrogramView& view); // Rows written since lastRow (updated), returns the number of rows
+		const uint8_t* getSpectrogramData();	// Whole ring, row-major, (rows * rowBytes) bytes
+		uint64_t getSpectrogramRowCount();		// Rows written since setup, the newest one is at ring row ((count - 1) % rows)
+
+		// Sparse bin tracking, updated on every captured sample alongside the full FFT
+		bool setupBinTracker(const std::vector<float>& frequencies, uint32_t windowSize = FFT_SIZE * 2); // Empty list: disable the tracker
+		float getBinMagnitude(uint32_t bin);	// Lock free, call it from the thread that calls setupBinTracker()
+
+	private:
+		void updateSpectrogram();
+		void updateBandBins();			// Filterbank limits for the current sample rate
+		void freeSpectrogram();
+
+	private:
+		// FFT capture and analysis
+		kiss_fftr_cfg	m_fftcfg;
+		float*			m_pSampleBuf;				// Capture ring with the last samples, to be sent to the FFT analyzer, Size is: (FFT_SIZE * 2)
+		float*			m_pFFTInput;				// Capture ring unrolled in chronological order, Size is: (FFT_SIZE * 2)
+		std::atomic<uint32_t>	m_uiWritePos = 0;	// Next write position in the capture ring
+		std::atomic<SoundBinTracker*>	m_pBinTracker;	// Sparse bin tracker, fed from the capture ring
+		std::atomic<uint64_t>	m_captureEpoch = 0;		// Odd while the audio thread is inside captureSamples, see setupBinTracker()
+		std::vector<float>	m_binFrequencies;		// Tracked frequencies, kept to rebuild the tracker if the sample rate changes
+		uint32_t		m_binWindowSize = 0;
+	public:
+		float			m_fAmplification = 1.0f;
+
+		// Group magnitudes into low, mid, and high frequency bands
+		float			m_lowFreqMax = 400.0f;		// Low frequency max value: Adjustable parameter
+		float			m_midFreqMax = 2000.0f;		// Mid frequency max value: Adjustable parameter
+
+	private:
+		// BEAT detection
+		float*			m_pEnergy;					// Energy buffer
+		uint32_t		m_iPosition = 1;			// Position
+		float			m_fIntensity = 0;			// Intensity
+	public:
+		float			m_fBeatRatio = 1.4f;		// Beat Ratio: Adjustable parameter
+		float			m_fFadeOut = 4.0f;			// Fade Out: Adjustable parameter
+		float			m_fBeat = 0;				// Beat detection (0 to 1)
+
+	private:
+		float*			m_pFFTFrequencies;		// FFT frequencies analyzed, size is: FFT_SIZE
+	public:
+		float*			m_pFFTBuffer;			// FFT magnitues, size is: FFT_SIZE
+		float			m_fLowFreqSum = 0.0f;
+		float			m_fMidFreqSum = 0.0f;
+		float			m_fHighFreqSum = 0.0f;
+
+	private:
+		// Spectrogram history
+		SpectrogramConfig	m_spectrogramConfig;
+		uint8_t*		m_pSpectrogram;			// Ring of rows, size is: (rows * m_spectrogramRowBytes)
+		float*			m_pSpectrogramRow;		// Row being converted, size is: columns
+		uint32_t*		m_pBandBins;			// First FFT bin of each band, size is: (bands + 1)
+		uint32_t		m_spectrogramColumns = 0;
+		uint32_t		m_spectrogramRowBytes = 0;
+		uint32_t		m_sampleRate;
+		std::atomic<uint64_t>	m_spectrogramRowCount = 0;
+	};
+}
@@ -0,0 +1,107 @@
+// SoundBinTracker.cpp
+// Spontz Demogroup
+
+#include "main.h"
+#include "sound/SoundBinTracker.h"
+
+namespace Phoenix {
+
+	#define SDFT_DAMPING 0.99999	// Slightly below 1, so rounding errors in the recursion fade out instead of accumulating
+
+	SoundBinTracker::SoundBinTracker(const std::vector<float>& frequencies, uint32_t windowSize, uint32_t sampleRate)
+		:
+		m_windowSize(windowSize ? windowSize : 1),
+		m_binCount(static_cast<uint32_t>(frequencies.size()))
+	{
+		m_pFrequencies = (float*)malloc(sizeof(float) * m_binCount);
+		m_pDelay = (float*)malloc(sizeof(float) * m_windowSize);
+		m_pStateRe = (double*)malloc(sizeof(double) * m_binCount);
+		m_pStateIm = (double*)malloc(sizeof(double) * m_binCount);
+		m_pCoefRe = (double*)malloc(sizeof(double) * m_binCount);
+		m_pCoefIm = (double*)malloc(sizeof(double) * m_binCount);
+		m_pCombRe = (double*)malloc(sizeof(double) * m_binCount);
+		m_pCombIm = (double*)malloc(sizeof(double) * m_binCount);
+		m_pMagnitudes = new std::atomic<float>[m_binCount];
+
+		if (m_pDelay)
+			memset(m_pDelay, 0, sizeof(float) * m_windowSize);
+
+		const double pi = 3.14159265358979323846;
+		double dampingN = pow(SDFT_DAMPING, static_cast<double>(m_windowSize));
+		for (uint32_t i = 0; i < m_binCount; i++) {
+			double w = 2.0 * pi * frequencies[i] / static_cast<double>(sampleRate);
+			m_pFrequencies[i] = frequencies[i];
+			m_pStateRe[i] = 0;
+			m_pStateIm[i] = 0;
+			m_pCoefRe[i] = SDFT_DAMPING * cos(w);
+			m_pCoefIm[i] = SDFT_DAMPING * sin(w);
+			m_pCombRe[i] = dampingN * cos(w * m_windowSize);
+			m_pCombIm[i] = dampingN * sin(w * m_windowSize);
+			m_pMagnitudes[i].store(0.0f, std::memory_order_relaxed);
+		}
+	}
+
+	SoundBinTracker::~SoundBinTracker()
+	{
+		free(m_pFrequencies);
+		free(m_pDelay);
+		free(m_pStateRe);
+		free(m_pStateIm);
+		free(m_pCoefRe);
+		free(m_pCoefIm);
+		free(m_pCombRe);
+		free(m_pCombIm);
+		delete[] m_pMagnitudes;
+	}
+
+	void SoundBinTracker::processSamples(const float* pSamples, uint32_t count)
+	{
+		// Y(n) = r*e^(jw) * Y(n-1) + x(n) - r^N*e^(jwN) * x(n-N)
+		// |Y(n)| is the magnitude of the DFT of the last N samples at frequency w, for any w (not only the FFT bins)
+		for (uint32_t s = 0; s < count; s++) {
+			double input = pSamples[s];
+			double output = m_pDelay[m_delayPos];	// Sample leaving the window
+			m_pDelay[m_delayPos] = pSamples[s];
+			if (++m_delayPos == m_windowSize)
+				m_delayPos = 0;
+
+			for (uint32_t i = 0; i < m_binCount; i++) {
+				double re = m_pStateRe[i];
+				double im = m_pStateIm[i];
+				m_pStateRe[i] = m_pCoefRe[i] * re - m_pCoefIm[i] * im + input - m_pCombRe[i] * output;
+				m_pStateIm[i] = m_pCoefRe[i] * im + m_pCoefIm[i] * re - m_pCombIm[i] * output;
+			}
+		}
+
+		// Same scaling as the FFT magnitudes
+		const double scaling = 2.0 / static_cast<double>(m_windowSize);
+		for (uint32_t i = 0; i < m_binCount; i++) {
+			double magnitude = sqrt(m_pStateRe[i] * m_pStateRe[i] + m_pStateIm[i] * m_pStateIm[i]) * scaling;
+			m_pMagnitudes[i].store(static_cast<float>(magnitude), std::memory_order_relaxed);
+		}
+	}
+
+	float SoundBinTracker::getMagnitude(uint32_t bin)
+	{
+		if (bin >= m_binCount)
+			return 0.0f;
+		return m_pMagnitudes[bin].load(std::memory_order_relaxed);
+	}
+
+	float SoundBinTracker::getFrequency(uint32_t bin)
+	{
+		if (bin >= m_binCount)
+			return 0.0f;
+		return m_pFrequencies[bin];
+	}
+
+	uint32_t SoundBinTracker::getBinCount()
+	{
+		return m_binCount;
+	}
+
+	uint32_t SoundBinTracker::getWindowSize()
+	{
+		return m_windowSize;
+	}
+}
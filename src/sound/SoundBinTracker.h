@@ -0,0 +1,45 @@
+// SoundBinTracker.h
+// Spontz Demogroup
+
+#pragma once
+
+#include "main.h"
+
+#include <atomic>
+#include <vector>
+
+namespace Phoenix {
+
+	// Tracks the magnitude of a few frequencies with a sliding DFT, updated on every sample.
+	// Much cheaper than a full FFT when only a handful of bins are needed (kick, hi-hat, tuned notes...)
+	class SoundBinTracker final {
+
+	public:
+		SoundBinTracker(const std::vector<float>& frequencies, uint32_t windowSize, uint32_t sampleRate);
+		~SoundBinTracker();
+
+	public:
+		void processSamples(const float* pSamples, uint32_t count); // Called from the audio thread with mono samples
+		float getMagnitude(uint32_t bin);	// Magnitude at the end of the last processed block
+		float getFrequency(uint32_t bin);
+		uint32_t getBinCount();
+		uint32_t getWindowSize();
+
+	private:
+		uint32_t		m_windowSize;			// Samples in the sliding window
+		uint32_t		m_binCount;
+		float*			m_pFrequencies;			// Tracked frequencies, size is: m_binCount
+		float*			m_pDelay;				// Last m_windowSize samples, size is: m_windowSize
+		uint32_t		m_delayPos = 0;
+
+		// Resonator state and coefficients, in double to keep the recursion accurate over long runs
+		double*			m_pStateRe;				// size is: m_binCount
+		double*			m_pStateIm;
+		double*			m_pCoefRe;				// r * e^(jw)
+		double*			m_pCoefIm;
+		double*			m_pCombRe;				// r^N * e^(jwN), applied to the sample leaving the window
+		double*			m_pCombIm;
+
+		std::atomic<float>*	m_pMagnitudes;		// Published after each block, size is: m_binCount
+	};
+}
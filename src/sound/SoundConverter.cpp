@@ -0,0 +1,300 @@
+// SoundConverter.cpp
+// Spontz Demogroup
+
+#include "main.h"
+#include "sound/SoundConverter.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <numeric>
+#include <thread>
+
+namespace Phoenix {
+
+	#define CONVERT_BLOCK_FRAMES	4096	// Frames processed on each decoder/converter call
+	#define CONVERT_WARMUP_FRAMES	2048	// Frames fed to the converter before each chunk, so the filter state is settled
+	#define CACHE_VERSION			1
+
+	// Header of the converted PCM cache files
+	struct PCMCacheHeader {
+		char		magic[4];		// "PXPC"
+		uint32_t	version;
+		uint32_t	channels;
+		uint32_t	sampleRate;
+		uint64_t	frameCount;
+	};
+
+	bool SoundConverter::convertToPCM(const void* pData, size_t dataSize, uint32_t channels, uint32_t sampleRate, const SoundLoadConfig& config, std::vector<float>& pcm)
+	{
+		std::vector<float> native;
+		uint32_t nativeChannels = 0;
+		uint32_t nativeSampleRate = 0;
+
+		if (!decodeNative(pData, dataSize, nativeChannels, nativeSampleRate, native))
+			return false;
+
+		uint64_t totalFrames = native.size() / nativeChannels;
+
+		// Already in the device format: nothing to convert
+		if (nativeChannels == channels && nativeSampleRate == sampleRate) {
+			pcm = std::move(native);
+			return true;
+		}
+
+		// The input is split in chunks that start on a frame where input and output are phase aligned, so each
+		// chunk can be resampled independently. The result matches a single pass over the file up to the
+		// low-pass filter warm-up: with a filtered quality the filter state at a chunk start is close, not identical
+		uint32_t rateGCD = std::gcd(nativeSampleRate, sampleRate);
+		uint64_t blockIn = nativeSampleRate / rateGCD;
+		uint64_t blockOut = sampleRate / rateGCD;
+
+		uint32_t threads = config.threadCount ? config.threadCount : std::thread::hardware_concurrency();
+		if (threads == 0)
+			threads = 1;
+		uint64_t chunkIn = (totalFrames + threads - 1) / threads;
+		chunkIn = (chunkIn + blockIn - 1) / blockIn * blockIn;
+		uint64_t warmup = (CONVERT_WARMUP_FRAMES + blockIn - 1) / blockIn * blockIn;
+
+		bool parallel = threads > 1 &&
+			static_cast<float>(totalFrames) >= config.parallelMinSeconds * static_cast<float>(nativeSampleRate) &&
+			chunkIn > warmup;
+
+		pcm.clear();
+		if (!parallel) {
+			return convertRange(native.data(), totalFrames, nativeChannels, nativeSampleRate, channels, sampleRate, config.quality, 0, 0, pcm);
+		}
+
+		uint32_t chunkCount = static_cast<uint32_t>((totalFrames + chunkIn - 1) / chunkIn);
+		std::vector<std::vector<float>> chunks(chunkCount);
+		std::vector<char> chunkResult(chunkCount, 0);
+		std::vector<std::thread> workers;
+
+		for (uint32_t i = 0; i < chunkCount; i++) {
+			workers.emplace_back([&, i]() {
+				uint64_t start = i * chunkIn;
+				uint64_t end = std::min(start + chunkIn, totalFrames);
+				uint64_t warmStart = start > warmup ? start - warmup : 0;
+				uint64_t skip = (start - warmStart) / blockIn * blockOut;
+				uint64_t frames = (i == chunkCount - 1) ? 0 : (end - start) / blockIn * blockOut; // The last chunk takes everything left
+				chunks[i].reserve(static_cast<size_t>(((end - start) / blockIn + 1) * blockOut * channels));
+				chunkResult[i] = convertRange(native.data() + warmStart * nativeChannels, totalFrames - warmStart,
+					nativeChannels, nativeSampleRate, channels, sampleRate, config.quality, skip, frames, chunks[i]);
+			});
+		}
+		for (auto& worker : workers)
+			worker.join();
+
+		size_t totalSamples = 0;
+		for (uint32_t i = 0; i < chunkCount; i++) {
+			if (!chunkResult[i])
+				return false;
+			totalSamples += chunks[i].size();
+		}
+		pcm.reserve(totalSamples);
+		for (auto const& chunk : chunks)
+			pcm.insert(pcm.end(), chunk.begin(), chunk.end());
+
+		return true;
+	}
+
+	std::string SoundConverter::getCacheFile(const SoundLoadConfig& config, uint64_t sourceHash, uint32_t channels, uint32_t sampleRate)
+	{
+		if (config.cachePath.empty())
+			return "";
+
+		char fileName[96];
+		snprintf(fileName, sizeof(fileName), "%016llx_%uch_%uhz_q%u.pcm", static_cast<unsigned long long>(sourceHash), channels, sampleRate, static_cast<uint32_t>(config.quality));
+		return (std::filesystem::path(config.cachePath) / fileName).string();
+	}
+
+	bool SoundConverter::loadCache(const std::string_view cacheFile, uint32_t channels, uint32_t sampleRate, std::vector<float>& pcm)
+	{
+		if (cacheFile.empty())
+			return false;
+
+		FILE* pFile = fopen(std::string(cacheFile).c_str(), "rb");
+		if (!pFile)
+			return false;
+
+		fseek(pFile, 0, SEEK_END);
+		long fileSize = ftell(pFile);
+		fseek(pFile, 0, SEEK_SET);
+
+		// The frame count must match the file size, a corrupt or truncated file is a cache miss
+		PCMCacheHeader header;
+		bool valid = fileSize >= static_cast<long>(sizeof(header)) &&
+			fread(&header, sizeof(header), 1, pFile) == 1 &&
+			memcmp(header.magic, "PXPC", 4) == 0 &&
+			header.version == CACHE_VERSION &&
+			header.channels == channels && channels > 0 &&
+			header.sampleRate == sampleRate &&
+			header.frameCount == (static_cast<uint64_t>(fileSize) - sizeof(header)) / (sizeof(float) * channels) &&
+			(static_cast<uint64_t>(fileSize) - sizeof(header)) % (sizeof(float) * channels) == 0;
+
+		if (valid) {
+			size_t samples = static_cast<size_t>(header.frameCount * channels);
+			pcm.resize(samples);
+			valid = fread(pcm.data(), sizeof(float), samples, pFile) == samples;
+		}
+		fclose(pFile);
+
+		if (!valid)
+			pcm.clear();
+		return valid;
+	}
+
+	bool SoundConverter::saveCache(const std::string_view cacheFile, uint32_t channels, uint32_t sampleRate, const std::vector<float>& pcm)
+	{
+		if (cacheFile.empty())
+			return false;
+
+		std::error_code ec;
+		std::filesystem::path path(cacheFile);
+		std::filesystem::create_directories(path.parent_path(), ec);
+
+		// Write to a temporary file first, so a crash never leaves a truncated cache behind
+		std::filesystem::path tmpPath = path;
+		tmpPath += ".tmp";
+		FILE* pFile = fopen(tmpPath.string().c_str(), "wb");
+		if (!pFile)
+			return false;
+
+		PCMCacheHeader header;
+		memcpy(header.magic, "PXPC", 4);
+		header.version = CACHE_VERSION;
+		header.channels = channels;
+		header.sampleRate = sampleRate;
+		header.frameCount = pcm.size() / channels;
+
+		bool ok = fwrite(&header, sizeof(header), 1, pFile) == 1 &&
+			fwrite(pcm.data(), sizeof(float), pcm.size(), pFile) == pcm.size();
+		fclose(pFile);
+
+		if (ok)
+			std::filesystem::rename(tmpPath, path, ec);
+		if (!ok || ec) {
+			std::filesystem::remove(tmpPath, ec);
+			return false;
+		}
+		return true;
+	}
+
+	bool SoundConverter::readFile(const std::string_view filePath, std::vector<uint8_t>& data)
+	{
+		FILE* pFile = fopen(std::string(filePath).c_str(), "rb");
+		if (!pFile)
+			return false;
+
+		fseek(pFile, 0, SEEK_END);
+		long size = ftell(pFile);
+		fseek(pFile, 0, SEEK_SET);
+		if (size <= 0) {
+			fclose(pFile);
+			return false;
+		}
+
+		data.resize(static_cast<size_t>(size));
+		bool ok = fread(data.data(), 1, data.size(), pFile) == data.size();
+		fclose(pFile);
+		return ok;
+	}
+
+	bool SoundConverter::readManifest(const std::string_view manifestFile, std::vector<std::string>& files)
+	{
+		FILE* pFile = fopen(std::string(manifestFile).c_str(), "r");
+		if (pFile == nullptr)
+			return false;
+
+		char line[1024];
+		while (fgets(line, sizeof(line), pFile)) {
+			std::string filePath(line);
+			// Trim spaces and line endings
+			size_t first = filePath.find_first_not_of(" \t\r\n");
+			size_t last = filePath.find_last_not_of(" \t\r\n");
+			if (first == std::string::npos || filePath[first] == '#')
+				continue;
+			files.push_back(filePath.substr(first, last - first + 1));
+		}
+		fclose(pFile);
+		return true;
+	}
+
+	uint64_t SoundConverter::hash(const void* pData, size_t dataSize)
+	{
+		// FNV-1a 64 bits
+		const uint8_t* p = static_cast<const uint8_t*>(pData);
+		uint64_t h = 14695981039346656037ull;
+		for (size_t i = 0; i < dataSize; i++) {
+			h ^= p[i];
+			h *= 1099511628211ull;
+		}
+		return h;
+	}
+
+	bool SoundConverter::decodeNative(const void* pData, size_t dataSize, uint32_t& channels, uint32_t& sampleRate, std::vector<float>& pcm)
+	{
+		ma_decoder decoder;
+		ma_decoder_config decoderConfig;
+
+		// Channels and sample rate set to 0 keep the native values of the file
+		decoderConfig = ma_decoder_config_init(ma_format_f32, 0, 0);
+		if (ma_decoder_init_memory(pData, dataSize, &decoderConfig, &decoder) != MA_SUCCESS)
+			return false;
+
+		ma_format format;
+		ma_decoder_get_data_format(&decoder, &format, &channels, &sampleRate, NULL, 0);
+
+		ma_uint64 length = 0;
+		if (ma_decoder_get_length_in_pcm_frames(&decoder, &length) == MA_SUCCESS && length > 0)
+			pcm.reserve(static_cast<size_t>(length * channels));
+
+		std::vector<float> temp(CONVERT_BLOCK_FRAMES * channels);
+		while (true) {
+			ma_uint64 framesRead = 0;
+			ma_result result = ma_decoder_read_pcm_frames(&decoder, temp.data(), CONVERT_BLOCK_FRAMES, &framesRead);
+			pcm.insert(pcm.end(), temp.begin(), temp.begin() + static_cast<size_t>(framesRead * channels));
+			if (result != MA_SUCCESS || framesRead < CONVERT_BLOCK_FRAMES)
+				break;
+		}
+		ma_decoder_uninit(&decoder);
+
+		return !pcm.empty();
+	}
+
+	bool SoundConverter::convertRange(const float* pInput, uint64_t inputFrames, uint32_t channelsIn, uint32_t sampleRateIn, uint32_t channelsOut, uint32_t sampleRateOut, ResampleQuality quality, uint64_t skipFrames, uint64_t maxFrames, std::vector<float>& output)
+	{
+		ma_data_converter converter;
+		ma_data_converter_config converterConfig;
+
+		converterConfig = ma_data_converter_config_init(ma_format_f32, ma_format_f32, channelsIn, channelsOut, sampleRateIn, sampleRateOut);
+		converterConfig.resampling.algorithm = ma_resample_algorithm_linear;
+		converterConfig.resampling.linear.lpfOrder = static_cast<ma_uint32>(quality);
+		if (ma_data_converter_init(&converterConfig, NULL, &converter) != MA_SUCCESS)
+			return false;
+
+		// Skip the warm-up frames and stop after maxFrames (0: convert until the input is exhausted)
+		uint64_t stopFrame = maxFrames ? skipFrames + maxFrames : UINT64_MAX;
+		uint64_t inputPos = 0;
+		uint64_t outputPos = 0;
+		std::vector<float> temp(CONVERT_BLOCK_FRAMES * channelsOut);
+
+		while (outputPos < stopFrame) {
+			ma_uint64 framesIn = inputFrames - inputPos;
+			ma_uint64 framesOut = std::min<uint64_t>(CONVERT_BLOCK_FRAMES, stopFrame - outputPos);
+
+			if (ma_data_converter_process_pcm_frames(&converter, pInput + inputPos * channelsIn, &framesIn, temp.data(), &framesOut) != MA_SUCCESS)
+				break;
+			if (framesIn == 0 && framesOut == 0)
+				break; // Input exhausted
+
+			uint64_t first = outputPos < skipFrames ? std::min<uint64_t>(skipFrames - outputPos, framesOut) : 0;
+			output.insert(output.end(), temp.begin() + static_cast<size_t>(first * channelsOut), temp.begin() + static_cast<size_t>(framesOut * channelsOut));
+
+			inputPos += framesIn;
+			outputPos += framesOut;
+		}
+
+		ma_data_converter_uninit(&converter, NULL);
+		return true;
+	}
+}
@@ -0,0 +1,51 @@
+// SoundConverter.h
+// Spontz Demogroup
+
+#pragma once
+
+#include "main.h"
+
+#include <stdio.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace Phoenix {
+
+	// Resampler quality, maps to the low-pass filter order of the miniaudio linear resampler
+	enum class ResampleQuality : uint32_t {
+		Fast = 0,		// Plain linear interpolation, no anti-aliasing filter
+		Medium = 4,		// 4th order low-pass filter
+		High = MA_MAX_FILTER_ORDER,	// Highest filter order supported by miniaudio
+	};
+
+	// Load-time conversion settings
+	struct SoundLoadConfig {
+		bool			preDecode = true;						// Convert the whole file to device-native PCM when loading
+		ResampleQuality	quality = ResampleQuality::Medium;		// Resampler quality used for the conversion
+		uint32_t		threadCount = 0;						// Threads used for long files (0: use all the cores). The SoundManager loads always use 1, its loader already uses all the cores
+		float			parallelMinSeconds = 30.0f;				// Files shorter than this are converted on a single thread
+		std::string		cachePath = "";							// Folder for the converted PCM cache (empty: disk cache disabled)
+		uint32_t		seekPointCount = 256;					// Seek table size built when the sound is not pre-decoded (0: no seek table)
+	};
+
+	class SoundConverter final {
+
+	public:
+		// Converts an encoded file (already in memory) to interleaved f32 PCM at the requested format
+		static bool convertToPCM(const void* pData, size_t dataSize, uint32_t channels, uint32_t sampleRate, const SoundLoadConfig& config, std::vector<float>& pcm);
+
+		// Disk cache, keyed by the hash of the source file and the target format
+		static std::string getCacheFile(const SoundLoadConfig& config, uint64_t sourceHash, uint32_t channels, uint32_t sampleRate);
+		static bool loadCache(const std::string_view cacheFile, uint32_t channels, uint32_t sampleRate, std::vector<float>& pcm);
+		static bool saveCache(const std::string_view cacheFile, uint32_t channels, uint32_t sampleRate, const std::vector<float>& pcm);
+
+		static bool readFile(const std::string_view filePath, std::vector<uint8_t>& data);
+		static bool readManifest(const std::string_view manifestFile, std::vector<std::string>& files); // One file per line, '#' for comments
+		static uint64_t hash(const void* pData, size_t dataSize);
+
+	private:
+		static bool decodeNative(const void* pData, size_t dataSize, uint32_t& channels, uint32_t& sampleRate, std::vector<float>& pcm);
+		static bool convertRange(const float* pInput, uint64_t inputFrames, uint32_t channelsIn, uint32_t sampleRateIn, uint32_t channelsOut, uint32_t sampleRateOut, ResampleQuality quality, uint64_t skipFrames, uint64_t maxFrames, std::vector<float>& output);
+	};
+}
@@ -0,0 +1,79 @@
+// SoundLoader.cpp
+// Spontz Demogroup
+
+#include "main.h"
+#include "sound/SoundLoader.h"
+
+namespace Phoenix {
+
+	SoundLoader::SoundLoader(uint32_t threadCount)
+		:
+		m_activeJobs(0),
+		m_stop(false)
+	{
+		if (threadCount == 0)
+			threadCount = std::thread::hardware_concurrency();
+		if (threadCount == 0)
+			threadCount = 1;
+
+		for (uint32_t i = 0; i < threadCount; i++)
+			m_workers.emplace_back(&SoundLoader::workerLoop, this);
+	}
+
+	SoundLoader::~SoundLoader()
+	{
+		// Pending jobs are finished before the workers quit
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_jobAvailable.notify_all();
+		for (auto& worker : m_workers)
+			worker.join();
+	}
+
+	void SoundLoader::submit(std::function<void()> job)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_jobs.push_back(std::move(job));
+		}
+		m_jobAvailable.notify_one();
+	}
+
+	void SoundLoader::wait()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_jobsDone.wait(lock, [this]() { return m_jobs.empty() && m_activeJobs == 0; });
+	}
+
+	uint32_t SoundLoader::getThreadCount()
+	{
+		return static_cast<uint32_t>(m_workers.size());
+	}
+
+	void SoundLoader::workerLoop()
+	{
+		while (true) {
+			std::function<void()> job;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_jobAvailable.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+				if (m_jobs.empty())
+					return; // Stop requested and nothing left to do
+				job = std::move(m_jobs.front());
+				m_jobs.pop_front();
+				m_activeJobs++;
+			}
+
+			job();
+
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_activeJobs--;
+				if (m_jobs.empty() && m_activeJobs == 0)
+					m_jobsDone.notify_all();
+			}
+		}
+	}
+}
@@ -0,0 +1,41 @@
+// SoundLoader.h
+// Spontz Demogroup
+
+#pragma once
+
+#include "main.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Phoenix {
+
+	// Worker pool used to load sounds in the background
+	class SoundLoader final {
+
+	public:
+		SoundLoader(uint32_t threadCount = 0); // 0: one worker per core
+		~SoundLoader();
+
+	public:
+		void submit(std::function<void()> job);	// Queue a job, it will be run by the first free worker
+		void wait();							// Wait until all the queued jobs are done
+		uint32_t getThreadCount();
+
+	private:
+		void workerLoop();
+
+	private:
+		std::vector<std::thread>			m_workers;
+		std::deque<std::function<void()>>	m_jobs;
+		std::mutex							m_mutex;
+		std::condition_variable				m_jobAvailable;
+		std::condition_variable				m_jobsDone;
+		uint32_t							m_activeJobs;
+		bool								m_stop;
+	};
+}
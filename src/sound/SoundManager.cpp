@@ -6,71 +6,69 @@
 
 namespace Phoenix {
 
-	SoundManager::SoundManager()
+	SoundManager::SoundManager(const SoundDeviceConfig& config)
 		:
+		m_deviceConfig(config),
 		m_channels(CHANNEL_COUNT),
 		m_sampleRate(SAMPLE_RATE),
+		m_pContext(nullptr),
 		m_pDevice(nullptr),
+		m_devicesDirty(false),
 		m_pOutputFFTF32(nullptr),
-		m_pSampleBuf(nullptr),
-		m_pFFTBuffer(nullptr),
-		m_pFFTFrequencies(nullptr),
-		m_pEnergy(nullptr)
+		m_pMixTempF32(nullptr),
+		m_pOutputAnalyzer(nullptr),
+		m_pInputAnalyzer(nullptr),
+		m_pLoader(nullptr),
+		m_pPack(nullptr),
+		m_pVoices(nullptr),
+		m_mixerEpoch(0),
+		m_xrunCount(0),
+		m_resetTiming(true)
 	{
 		ma_result result;
 
-		sound.clear();
 		m_LoadedSounds = 0;
 		m_inited = false;
+		m_lastXrunTime = m_lastAdaptTime = std::chrono::steady_clock::now();
 
-		// Setup FFT variables
-		// Sample buffer
-		m_pSampleBuf = (float*)malloc(sizeof(float) * FFT_SIZE * 2);
-		if (m_pSampleBuf != nullptr)
-			memset(m_pSampleBuf, 0, sizeof(float) * FFT_SIZE * 2);
-		
-		// FFT config
-		m_fftcfg = kiss_fftr_alloc(FFT_SIZE * 2, false, NULL, NULL);
-				
-		// FFT values buffer
-		m_pFFTBuffer = (float*)malloc(sizeof(float) * FFT_SIZE);
-		if (m_pFFTBuffer)
-			memset(m_pFFTBuffer, 0, sizeof(float) * FFT_SIZE);
-		
-		// FFT frequencies buffer
-		m_pFFTFrequencies = (float*)malloc(sizeof(float) * FFT_SIZE);
-		if (m_pFFTFrequencies) {
-			for (int32_t i = 0; i < FFT_SIZE; i++) {
-				m_pFFTFrequencies[i] = static_cast<float>(i) * (SAMPLE_RATE / 2.0f / FFT_SIZE);
-			}
-		}
+		// Handle table and voices, all the slots are free
+		m_pVoices = new SoundVoices();
+		memset(m_generations, 0, sizeof(m_generations));
+		for (uint32_t i = MAX_SOUNDS; i > 0; i--)
+			m_freeSlots.push_back(i - 1);
+
+		m_pLoader = new SoundLoader();
+
+		bool hasPlayback = m_deviceConfig.mode != DeviceMode::Capture;
+		bool hasCapture = m_deviceConfig.mode != DeviceMode::Playback;
+
+		// Setup the analyzers, the input can only be analyzed if we have a capture device
+		if (hasPlayback && m_deviceConfig.analysis != AnalysisSource::Input)
+			m_pOutputAnalyzer = new SoundAnalyzer(m_sampleRate);
+		if (hasCapture && m_deviceConfig.analysis != AnalysisSource::Output)
+			m_pInputAnalyzer = new SoundAnalyzer(m_sampleRate);
 
 		// FFT output buffer
 		m_pOutputFFTF32 = (float*)malloc(sizeof(float) * SAMPLE_STORAGE);
 		if (m_pOutputFFTF32)
 			memset(m_pOutputFFTF32, 0, sizeof(float) * SAMPLE_STORAGE);
+		m_pMixTempF32 = (float*)malloc(sizeof(float) * SAMPLE_STORAGE);
 
-		// BEAT buffer
-		m_pEnergy = (float*)malloc(sizeof(float) * FFT_SIZE);
-		if (m_pEnergy)
-			memset(m_pEnergy, 0, sizeof(float) * FFT_SIZE);
-
-		// Allocate space for structure
-		m_pDevice = (ma_device*)malloc(sizeof(ma_device));
+		// One context for the whole life of the manager, used for the enumeration and for every device we open
+		m_pContext = (ma_context*)malloc(sizeof(ma_context));
+		result = ma_context_init(NULL, 0, NULL, m_pContext);
+		if (result != MA_SUCCESS) {
+			free(m_pContext);
+			m_pContext = nullptr;
+			m_inited = false;
+			return;
+		}
+		updateDevices(true);
 
 		// Init the device
-		ma_device_config deviceConfig;
-		deviceConfig = ma_device_config_init(ma_device_type_playback);
-		deviceConfig.playback.format = SAMPLE_FORMAT;
-		deviceConfig.playback.channels = m_channels;
-		deviceConfig.sampleRate = m_sampleRate;
-		deviceConfig.dataCallback = dataCallback;
-		deviceConfig.pUserData = this;
-
-		result = ma_device_init(NULL, &deviceConfig, m_pDevice);
-		if (result != MA_SUCCESS) {
-			// Failed to open playback device
-			destroyDevice();
+		m_pDevice = createDevice(NULL, NULL, m_sampleRate);
+		if (m_pDevice == nullptr) {
+			// Failed to open the device
 			m_inited = false;
 			return;
 		}
@@ -87,21 +85,67 @@ namespace Phoenix {
 	{
 		ma_event_signal(&m_stopEvent);	// Send the signal to stop
 		ma_event_wait(&m_stopEvent);	// Wait the stop
+		delete m_pLoader;				// Finish the pending loads
 		destroyDevice();
 		clearSounds();
-		kiss_fft_free(m_fftcfg);		// Free fft
+		if (m_pPack)
+			delete m_pPack;
+		if (m_pContext) {
+			ma_context_uninit(m_pContext);
+			free(m_pContext);
+			m_pContext = nullptr;
+		}
 
-		// Delete internal buffers
-		if (m_pSampleBuf)
-			free(m_pSampleBuf);
+		// Delete analyzers and internal buffers
+		if (m_pOutputAnalyzer)
+			delete m_pOutputAnalyzer;
+		if (m_pInputAnalyzer)
+			delete m_pInputAnalyzer;
 		if (m_pOutputFFTF32)
 			free(m_pOutputFFTF32);
-		if (m_pFFTBuffer)
-			free(m_pFFTBuffer);
-		if (m_pFFTFrequencies)
-			free(m_pFFTFrequencies);
-		if (m_pEnergy)
-			free(m_pEnergy);
+		if (m_pMixTempF32)
+			free(m_pMixTempF32);
+		if (m_pVoices)
+			delete m_pVoices;
+	}
+
+	ma_device* SoundManager::createDevice(const ma_device_id* pPlaybackID, const ma_device_id* pCaptureID, uint32_t sampleRate)
+	{
+		if (m_pContext == nullptr)
+			return nullptr;
+
+		// Allocate space for structure
+		ma_device* pDevice = (ma_device*)malloc(sizeof(ma_device));
+
+		ma_device_config deviceConfig;
+		if (m_deviceConfig.mode == DeviceMode::Capture)
+			deviceConfig = ma_device_config_init(ma_device_type_capture);
+		else if (m_deviceConfig.mode == DeviceMode::Duplex)
+			deviceConfig = ma_device_config_init(ma_device_type_duplex);
+		else
+			deviceConfig = ma_device_config_init(ma_device_type_playback);
+		deviceConfig.playback.pDeviceID = pPlaybackID;
+		deviceConfig.playback.format = SAMPLE_FORMAT;
+		deviceConfig.playback.channels = m_channels;
+		deviceConfig.capture.pDeviceID = pCaptureID;
+		deviceConfig.capture.format = SAMPLE_FORMAT;
+		deviceConfig.capture.channels = 0;	// Native channel count, the analyzer does the downmix
+		deviceConfig.sampleRate = sampleRate;
+		deviceConfig.dataCallback = dataCallback;
+		deviceConfig.notificationCallback = notificationCallback;
+		deviceConfig.pUserData = this;
+		if (m_deviceConfig.latency == LatencyMode::LowLatency)
+			deviceConfig.performanceProfile = ma_performance_profile_low_latency;
+		else if (m_deviceConfig.latency == LatencyMode::Conservative)
+			deviceConfig.performanceProfile = ma_performance_profile_conservative;
+		deviceConfig.periodSizeInFrames = m_deviceConfig.periodSizeInFrames;	// A request, the backend may round it
+		deviceConfig.periods = m_deviceConfig.periods;
+
+		if (ma_device_init(m_pContext, &deviceConfig, pDevice) != MA_SUCCESS) {
+			free(pDevice);
+			return nullptr;
+		}
+		return pDevice;
 	}
 
 	void SoundManager::destroyDevice()
@@ -123,47 +167,313 @@ namespace Phoenix {
 		return false;
 	}
 
-	SP_Sound SoundManager::addSound(const std::string_view filePath)
+	SoundHandle SoundManager::addSound(const std::string_view filePath)
 	{
-		SP_Sound p_sound;
+		return addSoundAsync(filePath).get();
+	}
 
-		// check if sound is already loaded, then we just retrieve the ID of our sound
-		for (auto const& m_sound : sound) {
-			if (m_sound->filePath.compare(filePath) == 0) {
-				p_sound = m_sound;
-			}
+	SoundFuture SoundManager::addSoundAsync(const std::string_view filePath)
+	{
+		return loadAsync(filePath, m_loadConfig, nullptr);
+	}
+
+	std::vector<SoundFuture> SoundManager::preloadSounds(const std::vector<std::string>& filePaths, SoundProgressCallback progress)
+	{
+		std::vector<SoundFuture> futures;
+		auto loaded = std::make_shared<std::atomic<uint32_t>>(0);
+		uint32_t total = static_cast<uint32_t>(filePaths.size());
+
+		for (auto const& filePath : filePaths) {
+			futures.push_back(loadAsync(filePath, m_loadConfig, [loaded, total, filePath, progress](bool ok) {
+				uint32_t count = ++(*loaded);
+				if (progress)
+					progress(count, total, filePath, ok);
+			}));
+		}
+		return futures;
+	}
+
+	std::vector<SoundFuture> SoundManager::preloadManifest(const std::string_view manifestFile, SoundProgressCallback progress)
+	{
+		std::vector<std::string> filePaths;
+		if (!SoundConverter::readManifest(manifestFile, filePaths))
+			return {};
+
+		return preloadSounds(filePaths, progress);
+	}
+
+	void SoundManager::waitLoads()
+	{
+		m_pLoader->wait();
+	}
+
+	bool SoundManager::openPack(const std::string_view packFile)
+	{
+		closePack();
+
+		SoundPack* pPack = new SoundPack();
+		if (!pPack->open(packFile)) {
+			delete pPack;
+			return false;
+		}
+		std::lock_guard<std::mutex> lock(m_soundMutex);
+		m_pPack = pPack;
+		return true;
+	}
+
+	void SoundManager::closePack()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_soundMutex);
+			if (m_pPack == nullptr || m_packClosing)
+				return;
+			m_packClosing = true;
 		}
 
-		if (p_sound == nullptr) {
+		// No load may be reading the pack while we unmap it
+		waitLoads();
+		clearSounds();
+
+		std::lock_guard<std::mutex> lock(m_soundMutex);
+		delete m_pPack;
+		m_pPack = nullptr;
+		m_packClosing = false;
+	}
+
+	SoundFuture SoundManager::loadAsync(const std::string_view filePath, const SoundLoadConfig& config, std::function<void(bool ok)> onDone)
+	{
+		std::string path = SoundPack::normalizeName(filePath);
+		std::unique_lock<std::mutex> lock(m_soundMutex);
+
+		// The pack is about to be unmapped, and all the sounds cleared
+		if (m_packClosing) {
+			std::promise<SoundHandle> failed;
+			failed.set_value(SoundHandle());
+			if (onDone)
+				m_pLoader->submit([onDone]() { onDone(false); });
+			return failed.get_future().share();
+		}
+
+		// check if sound is already loaded (or being loaded), then we just retrieve it
+		auto loaded = m_soundsByPath.find(path);
+		if (loaded != m_soundsByPath.end()) {
+			std::promise<SoundHandle> ready;
+			ready.set_value(loaded->second);
+			if (onDone)
+				m_pLoader->submit([onDone]() { onDone(true); });	// Callbacks always run on the loading threads
+			return ready.get_future().share();
+		}
+		auto pending = m_pendingLoads.find(path);
+		if (pending != m_pendingLoads.end()) {
+			// The running load calls it, no worker waits for another one
+			if (onDone)
+				pending->second.callbacks.push_back(onDone);
+			return pending->second.future;
+		}
+
+		auto promise = std::make_shared<std::promise<SoundHandle>>();
+		SoundFuture future = promise->get_future().share();
+		m_pendingLoads[path].future = future;
+
+		// The loads already keep all the workers busy, so each file is converted on a single thread
+		SoundLoadConfig loadConfig = config;
+		loadConfig.threadCount = 1;
+
+		uint32_t channels = m_channels;
+		uint32_t sampleRate = m_sampleRate;
+		SoundPack* pPack = m_pPack;
+		m_pLoader->submit([this, path, config = loadConfig, channels, sampleRate, pPack, promise, onDone]() mutable {
+			// File I/O, decoding, conversion and seek table are all done here, out of the caller and audio threads
 			SP_Sound new_sound = std::make_shared<Sound>();
-			if (new_sound->loadSoundFile(filePath, m_channels, m_sampleRate)) {
-				sound.push_back(new_sound);
-				printf("\nSound %s loaded OK", filePath.data());
-				m_LoadedSounds++;
-				p_sound = new_sound;
-			}
-			else {
-				printf("\nCould not load song: %s", filePath.data());
+			SoundHandle handle;
+			SoundPackAsset asset;
+			bool ok;
+			if (pPack && pPack->findAsset(path, asset))
+				ok = new_sound->loadSoundAsset(asset, channels, sampleRate, config);
+			else
+				ok = new_sound->loadSoundFile(path, channels, sampleRate, config);
+
+			// Publish to the mixer only once the sound is fully ready
+			std::vector<std::function<void(bool ok)>> callbacks;
+			{
+				std::unique_lock<std::mutex> lock(m_soundMutex);
+
+				// switchDevice only converts the published sounds: if the rate changed meanwhile, convert this one again
+				while (ok && m_sampleRate != sampleRate) {
+					sampleRate = m_sampleRate;
+					lock.unlock();
+					ok = new_sound->reloadSoundFile(channels, sampleRate, config);
+					lock.lock();
+				}
+				if (ok)
+					handle = publishSound(new_sound, path);
+				callbacks = std::move(m_pendingLoads[path].callbacks);
+				m_pendingLoads.erase(path);
 			}
+			promise->set_value(handle);
+			if (onDone)
+				onDone(handle.isValid());
+			for (auto& callback : callbacks)
+				callback(handle.isValid());
+		});
+		return future;
+	}
+
+	SoundHandle SoundManager::publishSound(SP_Sound newSound, const std::string& path)
+	{
+		SoundHandle handle;
+		if (m_freeSlots.empty())
+			return handle;
+
+		uint32_t slot = m_freeSlots.back();
+		m_freeSlots.pop_back();
+		m_sounds[slot] = newSound;
+		handle.index = slot;
+		handle.generation = m_generations[slot];
+		m_soundsByPath[path] = handle;
+		m_LoadedSounds++;
+
+		// The state is written last: once the mixer sees it, the rest of the voice is ready
+		m_pVoices->source[slot] = newSound->getDataSource();
+		m_pVoices->gain[slot].store(1.0f, std::memory_order_relaxed);
+		m_pVoices->cursor[slot].store(0, std::memory_order_relaxed);
+		m_pVoices->seek[slot].store(NO_SEEK, std::memory_order_relaxed);
+		m_pVoices->state[slot].store(Sound::State::Stopped, std::memory_order_release);
+		if (slot >= m_pVoices->count.load(std::memory_order_relaxed))
+			m_pVoices->count.store(slot + 1, std::memory_order_release);
+
+		return handle;
+	}
+
+	bool SoundManager::isValid(SoundHandle handle)
+	{
+		return handle.index < MAX_SOUNDS && m_generations[handle.index] == handle.generation && m_sounds[handle.index] != nullptr;
+	}
+
+	void SoundManager::waitMixer()
+	{
+		// If the mixer is inside the callback, wait until it leaves it
+		uint64_t epoch = m_mixerEpoch.load();
+		if (epoch & 1) {
+			while (m_mixerEpoch.load() == epoch)
+				std::this_thread::yield();
 		}
-		return p_sound;
+	}
 
+	SoundHandle SoundManager::findSound(const std::string_view filePath)
+	{
+		std::lock_guard<std::mutex> lock(m_soundMutex);
+		auto loaded = m_soundsByPath.find(SoundPack::normalizeName(filePath));
+		if (loaded == m_soundsByPath.end())
+			return SoundHandle();
+		return loaded->second;
 	}
 
-	SP_Sound SoundManager::getSoundbyID(uint32_t id)
+	SP_Sound SoundManager::getSound(SoundHandle handle)
 	{
-		if (id >= sound.size())
+		std::lock_guard<std::mutex> lock(m_soundMutex);
+		if (!isValid(handle))
 			return nullptr;
 		else
-			return sound[id];
+			return m_sounds[handle.index];
+	}
+
+	uint32_t SoundManager::getSoundCount()
+	{
+		std::lock_guard<std::mutex> lock(m_soundMutex);
+		return static_cast<uint32_t>(m_LoadedSounds);
 	}
 
 	void SoundManager::clearSounds()
 	{
-		sound.clear();
+		std::lock_guard<std::mutex> lock(m_soundMutex);
+		uint32_t count = m_pVoices->count.load();
+
+		// Take the voices out of the mix, and make sure the mixer is not reading them anymore before unloading
+		for (uint32_t i = 0; i < count; i++)
+			m_pVoices->state[i].store(Sound::State::NotReady);
+		m_pVoices->count.store(0);
+		waitMixer();
+
+		for (uint32_t i = 0; i < count; i++) {
+			if (m_sounds[i]) {
+				m_sounds[i].reset();
+				m_pVoices->source[i] = nullptr;
+				m_generations[i]++;
+			}
+		}
+		m_freeSlots.clear();
+		for (uint32_t i = MAX_SOUNDS; i > 0; i--)
+			m_freeSlots.push_back(i - 1);
+		m_soundsByPath.clear();
 		m_LoadedSounds = 0;
 	}
 
+	bool SoundManager::playSound(SoundHandle handle)
+	{
+		std::lock_guard<std::mutex> lock(m_soundMutex);
+		if (!isValid(handle) || m_pVoices->source[handle.index] == nullptr)
+			return false;
+		m_pVoices->state[handle.index].store(Sound::State::Playing, std::memory_order_release);
+		return true;
+	}
+
+	bool SoundManager::stopSound(SoundHandle handle)
+	{
+		std::lock_guard<std::mutex> lock(m_soundMutex);
+		if (!isValid(handle) || m_pVoices->source[handle.index] == nullptr)
+			return false;
+		m_pVoices->state[handle.index].store(Sound::State::Stopped, std::memory_order_release);
+		return true;
+	}
+
+	bool SoundManager::restartSound(SoundHandle handle)
+	{
+		return seekSound(handle, 0.0f);
+	}
+
+	bool SoundManager::seekSound(SoundHandle handle, float second)
+	{
+		std::lock_guard<std::mutex> lock(m_soundMutex);
+		if (!isValid(handle) || second < 0)
+			return false;
+
+		// The mixer applies the seek, so the data source is never used from two threads at the same time
+		float myFFrame = static_cast<float>(m_sampleRate) * second;
+		uint64_t myFrame = static_cast<uint64_t>(myFFrame);
+		m_pVoices->seek[handle.index].store(myFrame, std::memory_order_release);
+		return true;
+	}
+
+	bool SoundManager::setSoundVolume(SoundHandle handle, float volume)
+	{
+		std::lock_guard<std::mutex> lock(m_soundMutex);
+		if (!isValid(handle))
+			return false;
+		m_pVoices->gain[handle.index].store(volume, std::memory_order_relaxed);
+		return true;
+	}
+
+	Sound::State SoundManager::getSoundState(SoundHandle handle)
+	{
+		std::lock_guard<std::mutex> lock(m_soundMutex);
+		if (!isValid(handle))
+			return Sound::State::NotReady;
+		return static_cast<Sound::State>(m_pVoices->state[handle.index].load(std::memory_order_acquire));
+	}
+
+	float SoundManager::getSoundPosition(SoundHandle handle)
+	{
+		std::lock_guard<std::mutex> lock(m_soundMutex);
+		if (!isValid(handle))
+			return 0.0f;
+
+		uint64_t frame = m_pVoices->seek[handle.index].load(std::memory_order_acquire);
+		if (frame == NO_SEEK)
+			frame = m_pVoices->cursor[handle.index].load(std::memory_order_relaxed);
+		return static_cast<float>(frame) / static_cast<float>(m_sampleRate);
+	}
+
 	std::string SoundManager::getVersion()
 	{
 		std::string ma_version;
@@ -173,8 +483,10 @@ namespace Phoenix {
 
 	void SoundManager::playDevice()
 	{
-		if (m_pDevice)
+		if (m_pDevice) {
+			m_resetTiming = true;
 			ma_device_start(m_pDevice);
+		}
 	}
 
 	void SoundManager::stopDevice()
@@ -184,49 +496,320 @@ namespace Phoenix {
 	}
 
 	void SoundManager::enumerateDevices()
+	{
+		ma_uint32 iDevice;
+
+		refreshDevices();
+
+		printf("Playback Devices\n");
+		for (iDevice = 0; iDevice < m_playbackDevices.size(); ++iDevice) {
+			printf("    %u: %s\n", iDevice, m_playbackDevices[iDevice].name);
+		}
+
+		printf("\n");
+
+		printf("Capture Devices\n");
+		for (iDevice = 0; iDevice < m_captureDevices.size(); ++iDevice) {
+			printf("    %u: %s\n", iDevice, m_captureDevices[iDevice].name);
+		}
+	}
+
+	bool SoundManager::refreshDevices()
+	{
+		return updateDevices(true);
+	}
+
+	bool SoundManager::updateDevices(bool force)
 	{
 		ma_result result;
-		ma_context context;
 		ma_device_info* pPlaybackDeviceInfos;
 		ma_uint32 playbackDeviceCount;
 		ma_device_info* pCaptureDeviceInfos;
 		ma_uint32 captureDeviceCount;
-		ma_uint32 iDevice;
 
-		if (ma_context_init(NULL, 0, NULL, &context) != MA_SUCCESS) {
-			printf("Failed to initialize context.\n");
-			return;
-		}
+		if (m_pContext == nullptr)
+			return false;
+
+		// Nothing to do unless the backend told us something changed
+		if (!m_devicesDirty.exchange(false) && !force)
+			return false;
 
-		result = ma_context_get_devices(&context, &pPlaybackDeviceInfos, &playbackDeviceCount, &pCaptureDeviceInfos, &captureDeviceCount);
+		result = ma_context_get_devices(m_pContext, &pPlaybackDeviceInfos, &playbackDeviceCount, &pCaptureDeviceInfos, &captureDeviceCount);
 		if (result != MA_SUCCESS) {
-			printf("Failed to retrieve device information.\n");
-			return;
+			return false;
 		}
 
-		printf("Playback Devices\n");
-		for (iDevice = 0; iDevice < playbackDeviceCount; ++iDevice) {
-			printf("    %u: %s\n", iDevice, pPlaybackDeviceInfos[iDevice].name);
+		auto sameList = [](const std::vector<ma_device_info>& list, const ma_device_info* pInfos, ma_uint32 count) {
+			if (list.size() != count)
+				return false;
+			for (ma_uint32 i = 0; i < count; i++) {
+				if (memcmp(&list[i].id, &pInfos[i].id, sizeof(ma_device_id)) != 0 ||
+					list[i].isDefault != pInfos[i].isDefault ||
+					strcmp(list[i].name, pInfos[i].name) != 0)
+					return false;
+			}
+			return true;
+		};
+
+		if (sameList(m_playbackDevices, pPlaybackDeviceInfos, playbackDeviceCount) &&
+			sameList(m_captureDevices, pCaptureDeviceInfos, captureDeviceCount))
+			return false;
+
+		m_playbackDevices.assign(pPlaybackDeviceInfos, pPlaybackDeviceInfos + playbackDeviceCount);
+		m_captureDevices.assign(pCaptureDeviceInfos, pCaptureDeviceInfos + captureDeviceCount);
+
+		if (m_deviceListCallback)
+			m_deviceListCallback();
+		return true;
+	}
+
+	const std::vector<ma_device_info>& SoundManager::getPlaybackDevices()
+	{
+		updateDevices();
+		return m_playbackDevices;
+	}
+
+	const std::vector<ma_device_info>& SoundManager::getCaptureDevices()
+	{
+		updateDevices();
+		return m_captureDevices;
+	}
+
+	void SoundManager::setDeviceListCallback(std::function<void()> callback)
+	{
+		m_deviceListCallback = callback;
+	}
+
+	bool SoundManager::switchDevice(int32_t playbackDevice, int32_t captureDevice, uint32_t sampleRate)
+	{
+		if (!m_inited)
+			return false;
+
+		if (playbackDevice >= static_cast<int32_t>(m_playbackDevices.size()) || captureDevice >= static_cast<int32_t>(m_captureDevices.size()))
+			return false;
+
+		const ma_device_id* pPlaybackID = playbackDevice < 0 ? NULL : &m_playbackDevices[playbackDevice].id;
+		const ma_device_id* pCaptureID = captureDevice < 0 ? NULL : &m_captureDevices[captureDevice].id;
+
+		// A different device, the adaptive controller starts from scratch
+		m_adaptFloor = 0;
+		m_adaptCantGrow = false;
+		m_adaptCantShrink = false;
+		return recreateDevice(pPlaybackID, pCaptureID, sampleRate);
+	}
+
+	bool SoundManager::recreateDevice(const ma_device_id* pPlaybackID, const ma_device_id* pCaptureID, uint32_t sampleRate)
+	{
+		if (sampleRate == 0)
+			sampleRate = m_sampleRate;
+
+		// Open the new device while the old one keeps playing: this is the slow part of the swap
+		ma_device* pNewDevice = createDevice(pPlaybackID, pCaptureID, sampleRate);
+		if (pNewDevice == nullptr)
+			return false;
+
+		// A new sample rate requires the pre-decoded sounds to be converted again. The conversions run on the
+		// loader, into new sounds, while the old device keeps playing
+		std::vector<SP_Sound> oldSounds;
+		std::vector<SP_Sound> newSounds;
+		if (sampleRate != m_sampleRate) {
+			{
+				std::lock_guard<std::mutex> lock(m_soundMutex);
+				oldSounds.assign(m_sounds, m_sounds + m_pVoices->count.load());
+			}
+			newSounds.resize(oldSounds.size());
+
+			SoundLoadConfig config = m_loadConfig;
+			config.threadCount = 1;	// The loader already uses all the cores
+			std::vector<std::future<void>> conversions;
+			for (size_t i = 0; i < oldSounds.size(); i++) {
+				if (oldSounds[i] == nullptr)
+					continue;
+				auto done = std::make_shared<std::promise<void>>();
+				conversions.push_back(done->get_future());
+				uint32_t channels = m_channels;
+				SP_Sound pOldSound = oldSounds[i];
+				SP_Sound* pNewSound = &newSounds[i];
+				m_pLoader->submit([pOldSound, pNewSound, channels, sampleRate, config, done]() {
+					SP_Sound sound = std::make_shared<Sound>();
+					if (sound->loadSoundFrom(*pOldSound, channels, sampleRate, config))
+						*pNewSound = sound;
+					done->set_value();
+				});
+			}
+			for (auto& conversion : conversions)
+				conversion.wait();
 		}
 
-		printf("\n");
+		// Only the swap itself happens with the sound stopped
+		ma_device* pOldDevice = m_pDevice;
+		bool wasStarted = ma_device_is_started(pOldDevice);
+		if (wasStarted)
+			ma_device_stop(pOldDevice);
+
+		if (sampleRate != m_sampleRate) {
+			std::lock_guard<std::mutex> lock(m_soundMutex);
+			uint32_t count = m_pVoices->count.load();
+			for (uint32_t i = 0; i < count; i++) {
+				if (m_sounds[i] == nullptr)
+					continue;
+
+				// Sounds published after the conversions started are converted here, it should be rare
+				SP_Sound newSound = i < oldSounds.size() && m_sounds[i] == oldSounds[i] ? newSounds[i] : nullptr;
+				if (newSound == nullptr) {
+					newSound = std::make_shared<Sound>();
+					if (!newSound->loadSoundFrom(*m_sounds[i], m_channels, sampleRate, m_loadConfig))
+						newSound = nullptr;
+				}
+				if (newSound == nullptr) {
+					// No version at the new rate: take the voice out of the mix, it can't be played anymore
+					m_pVoices->state[i].store(Sound::State::NotReady);
+					m_pVoices->source[i] = nullptr;
+					continue;
+				}
 
-		printf("Capture Devices\n");
-		for (iDevice = 0; iDevice < captureDeviceCount; ++iDevice) {
-			printf("    %u: %s\n", iDevice, pCaptureDeviceInfos[iDevice].name);
+				// Keep the position, converted to the new rate
+				uint64_t frame = m_pVoices->seek[i].load();
+				if (frame == NO_SEEK)
+					frame = m_pVoices->cursor[i].load();
+				frame = frame * sampleRate / m_sampleRate;
+				m_sounds[i] = newSound;
+				m_pVoices->source[i] = newSound->getDataSource();
+				m_pVoices->cursor[i].store(frame);
+				m_pVoices->seek[i].store(frame);
+			}
+			m_sampleRate = sampleRate;
+			if (m_pOutputAnalyzer)
+				m_pOutputAnalyzer->setSampleRate(m_sampleRate);
+			if (m_pInputAnalyzer)
+				m_pInputAnalyzer->setSampleRate(m_sampleRate);
+		}
+
+		// Remember the device, the adaptive latency controller reopens the same one
+		m_defaultPlayback = pPlaybackID == NULL;
+		m_defaultCapture = pCaptureID == NULL;
+		if (pPlaybackID)
+			m_playbackID = *pPlaybackID;
+		if (pCaptureID)
+			m_captureID = *pCaptureID;
+		m_xrunCount = 0;
+		m_lastXrunCount = 0;
+
+		// Sounds and analyzers are untouched, so playback resumes where it was
+		m_pDevice = pNewDevice;
+		if (wasStarted) {
+			m_resetTiming = true;
+			ma_device_start(m_pDevice);
+		}
+
+		ma_device_uninit(pOldDevice);
+		free(pOldDevice);
+
+		return true;
+	}
+
+	SoundLatencyInfo SoundManager::getLatencyInfo()
+	{
+		SoundLatencyInfo info;
+		if (m_pDevice == nullptr)
+			return info;
+
+		// Use the internal values: what the backend really gave us, not what we asked for
+		auto bufferMs = [](ma_uint32 periodSize, ma_uint32 periods, ma_uint32 sampleRate) {
+			return sampleRate ? 1000.0f * periodSize * periods / sampleRate : 0.0f;
+		};
+		if (m_pDevice->type != ma_device_type_capture) {
+			info.periodSizeInFrames = m_pDevice->playback.internalPeriodSizeInFrames;
+			info.periods = m_pDevice->playback.internalPeriods;
+			info.playbackMs = bufferMs(m_pDevice->playback.internalPeriodSizeInFrames, m_pDevice->playback.internalPeriods, m_pDevice->playback.internalSampleRate);
+		}
+		if (m_pDevice->type != ma_device_type_playback) {
+			if (m_pDevice->type == ma_device_type_capture) {
+				info.periodSizeInFrames = m_pDevice->capture.internalPeriodSizeInFrames;
+				info.periods = m_pDevice->capture.internalPeriods;
+			}
+			info.captureMs = bufferMs(m_pDevice->capture.internalPeriodSizeInFrames, m_pDevice->capture.internalPeriods, m_pDevice->capture.internalSampleRate);
+		}
+		info.totalMs = info.playbackMs + info.captureMs;
+		info.xruns = m_xrunCount.load(std::memory_order_relaxed);
+		return info;
+	}
+
+	bool SoundManager::updateLatency()
+	{
+		using namespace std::chrono;
+
+		if (!m_inited || m_pDevice == nullptr || !m_deviceConfig.adaptiveLatency)
+			return false;
+
+		auto now = steady_clock::now();
+		if (now - m_lastAdaptTime < seconds(1))
+			return false;	// Let the last change settle, the xruns are kept for the next call
+
+		uint32_t period = getLatencyInfo().periodSizeInFrames;
+		uint32_t xruns = m_xrunCount.load(std::memory_order_relaxed);
+		uint32_t target = period;
+		bool grow = false;
+
+		if (xruns != m_lastXrunCount) {
+			// Grow fast: each xrun is an audible glitch. Don't retry this period until a long clean run
+			m_lastXrunCount = xruns;
+			m_lastXrunTime = now;
+			if (!m_adaptCantGrow) {
+				target = std::max(period, std::min(period * 2, m_deviceConfig.maxPeriodSizeInFrames));
+				grow = true;
+			}
+			m_adaptFloor = std::max(m_adaptFloor, period * 2);
+		}
+		else if (now - m_lastXrunTime > seconds(30) && now - m_lastAdaptTime > seconds(30) && !m_adaptCantShrink) {
+			// Shrink slowly, after a long run without xruns. After a longer one, retry the periods that failed before
+			if (now - m_lastXrunTime > minutes(5))
+				m_adaptFloor = 0;
+			target = std::max({ period / 2, m_deviceConfig.minPeriodSizeInFrames, m_adaptFloor });
+		}
+
+		if (target == period || target == 0)
+			return false;
+
+		uint32_t requested = m_deviceConfig.periodSizeInFrames;
+		m_deviceConfig.periodSizeInFrames = target;
+		ma_device_id playbackID = m_playbackID;
+		ma_device_id captureID = m_captureID;
+		bool ok = recreateDevice(m_defaultPlayback ? NULL : &playbackID, m_defaultCapture ? NULL : &captureID, m_sampleRate);
+		m_lastAdaptTime = now;
+		if (!ok) {
+			m_deviceConfig.periodSizeInFrames = requested;
+			return false;
 		}
 
-		ma_context_uninit(&context);
+		// The period is only a request: if the backend kept its own size (e.g. WASAPI shared mode), stop asking
+		uint32_t achieved = getLatencyInfo().periodSizeInFrames;
+		if (grow ? achieved <= period : achieved >= period) {
+			if (grow)
+				m_adaptCantGrow = true;
+			else
+				m_adaptCantShrink = true;
+			m_deviceConfig.periodSizeInFrames = requested;
+		}
+		return achieved != period;
+	}
+
+	void SoundManager::notificationCallback(const ma_device_notification* pNotification)
+	{
+		SoundManager* p_sm = (SoundManager*)pNotification->pDevice->pUserData;
 
+		// The default device changed: the device lists need a refresh. A plain stop is not a change,
+		// it happens on every stopDevice() and device swap
+		if (pNotification->type == ma_device_notification_type_rerouted)
+			p_sm->m_devicesDirty = true;
 	}
 
-	ma_uint32 SoundManager::read_and_mix_pcm_frames_f32(ma_decoder* pDecoder, float volume, float* pOutputF32, float* pOutputFFTF32, ma_uint32 frameCount)
+	ma_uint32 SoundManager::read_and_mix_pcm_frames_f32(ma_data_source* pDataSource, float volume, float* pOutputF32, float* pOutputFFTF32, float* pTempF32, ma_uint32 frameCount)
 	{
 		// The way mixing works is that we just read into a temporary buffer, then take the contents of that buffer and mix it with the
 		// contents of the output buffer by simply adding the samples together. You could also clip the samples to -1..+1, but I'm not
 		//doing that in this example.
 		ma_result result;
-		std::vector<float> temp(SAMPLE_STORAGE);
 		ma_uint32 tempCapInFrames = SAMPLE_STORAGE / CHANNEL_COUNT;
 		ma_uint32 totalFramesRead = 0;
 
@@ -240,7 +823,7 @@ namespace Phoenix {
 				framesToReadThisIteration = totalFramesRemaining;
 			}
 
-			result = ma_decoder_read_pcm_frames(pDecoder, temp.data(), framesToReadThisIteration, &framesReadThisIteration);
+			result = ma_data_source_read_pcm_frames(pDataSource, pTempF32, framesToReadThisIteration, &framesReadThisIteration);
 			if (result != MA_SUCCESS || framesReadThisIteration == 0) {
 				break;
 			}
@@ -249,8 +832,8 @@ namespace Phoenix {
 			/* Mix the frames together. */
 			for (iSample = 0; iSample < framesReadThisIteration * CHANNEL_COUNT; ++iSample) {
 				iOutputSample = totalFramesRead * CHANNEL_COUNT + iSample;
-				pOutputF32[iOutputSample] += temp[iSample] * volume;
-				pOutputFFTF32[iOutputSample] += temp[iSample];
+				pOutputF32[iOutputSample] += pTempF32[iSample] * volume;
+				pOutputFFTF32[iOutputSample] += pTempF32[iSample];
 			}
 
 			totalFramesRead += (ma_uint32)framesReadThisIteration;
@@ -266,110 +849,109 @@ namespace Phoenix {
 
 	void SoundManager::dataCallback(ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount)
 	{
-		(void)pInput; // added to avoid compiler warnings. It does nothing.
-		float* pOutputF32 = (float*)pOutput;
 		SoundManager* p_sm = (SoundManager*)pDevice->pUserData;
-		memset(p_sm->m_pOutputFFTF32, 0, sizeof(float) * SAMPLE_STORAGE);
-
-		for (auto const& mySound : (p_sm->sound)) {
-			if (mySound->status == Sound::State::Playing) {
-				ma_uint32 framesRead = read_and_mix_pcm_frames_f32(mySound->getDecoder(), mySound->volume, pOutputF32, p_sm->m_pOutputFFTF32, frameCount);
-				if (framesRead < frameCount) {
-					mySound->stopSound();
-				}
+		auto callbackStart = std::chrono::steady_clock::now();
+
+		// Input frames go straight from the device buffer to the analyzer capture ring
+		if (pInput && p_sm->m_pInputAnalyzer)
+			p_sm->m_pInputAnalyzer->captureSamples((const float*)pInput, pDevice->capture.channels, frameCount);
+
+		// Capture only devices have nothing to play
+		if (pOutput != nullptr) {
+			// The backend may ask for more frames than our buffers can hold (big periods, or a period
+			// different from the requested one), so the mix is rendered in blocks of SAMPLE_STORAGE samples
+			float* pOutputF32 = (float*)pOutput;
+			const ma_uint32 blockFrames = SAMPLE_STORAGE / CHANNEL_COUNT;
+			p_sm->m_mixerEpoch.fetch_add(1);
+			for (ma_uint32 offset = 0; offset < frameCount; offset += blockFrames) {
+				ma_uint32 frames = frameCount - offset < blockFrames ? frameCount - offset : blockFrames;
+				p_sm->mixBlock(pOutputF32 + offset * CHANNEL_COUNT, frames);
 			}
+			p_sm->m_mixerEpoch.fetch_add(1);
 		}
 
-		// Fill the sampleBuffer for the FFT analysis
-		frameCount = frameCount < FFT_SIZE * 2 ? frameCount : FFT_SIZE * 2;
-
-		// Just rotate the buffer; copy existing, append new - https://github.com/Gargaj/Bonzomatic/blob/master/src/platform_common/FFT.cpp
-		const float* samples = (const float*)p_sm->m_pOutputFFTF32;
-		if (samples) {
-			float* p_sample = p_sm->m_pSampleBuf;
-			for (uint32_t i = frameCount; i < (FFT_SIZE * 2); i++) {
-				*(p_sample++) = p_sm->m_pSampleBuf[i];
-			}
-			for (uint32_t i = 0; i < frameCount; i++) {
-				*(p_sample++) = (samples[i * 2] + samples[i * 2 + 1]) / 2.0f * p_sm->m_fAmplification;
-			}
-		}
+		p_sm->checkXrun(pDevice, frameCount, callbackStart);
 	}
 
-	bool SoundManager::performFFT(float frameTime)
+	void SoundManager::mixBlock(float* pOutputF32, ma_uint32 frameCount)
 	{
-		if (!m_inited) {
-			return false;
-		}
-
-		kiss_fft_cpx out[FFT_SIZE + 1];			// FFT complex output
-		kiss_fftr(m_fftcfg, m_pSampleBuf, out);
-
-
-		m_fLowFreqSum = 0.0f;
-		m_fMidFreqSum = 0.0f;
-		m_fHighFreqSum = 0.0f;
-		m_fBeat = 0.0f;
-
-		for (uint32_t i = 0; i < FFT_SIZE; i++)
-		{
-			// Calculate the FFT buffer
-			static const float scaling = 1.0f / (float)FFT_SIZE;
-			m_pFFTBuffer[i] = 2.0f * sqrtf(out[i].r * out[i].r + out[i].i * out[i].i) * scaling;
-
-			// Calculate the maximum value of the Low, Medium and High frequencies
-			if (m_pFFTFrequencies[i] <= m_lowFreqMax) {
-				m_fLowFreqSum += m_pFFTBuffer[i];
+		memset(m_pOutputFFTF32, 0, sizeof(float) * frameCount * CHANNEL_COUNT);
+
+		// Scan the voices linearly, only the playing ones touch their data source
+		SoundVoices* pVoices = m_pVoices;
+		uint32_t count = pVoices->count.load();	// Sequentially consistent with the epoch, see waitMixer()
+		for (uint32_t i = 0; i < count; i++) {
+			if (pVoices->state[i].load(std::memory_order_acquire) != Sound::State::Playing)
+				continue;
+
+			ma_data_source* pSource = pVoices->source[i];
+			uint64_t seek = pVoices->seek[i].exchange(NO_SEEK, std::memory_order_acquire);
+			if (seek != NO_SEEK) {
+				ma_data_source_seek_to_pcm_frame(pSource, seek);
+				pVoices->cursor[i].store(seek, std::memory_order_relaxed);
 			}
-			else if (m_pFFTFrequencies[i] <= m_midFreqMax) {
-				m_fMidFreqSum += m_pFFTBuffer[i];
-			}
-			else {
-				m_fHighFreqSum += m_pFFTBuffer[i];
+
+			ma_uint32 framesRead = read_and_mix_pcm_frames_f32(pSource, pVoices->gain[i].load(std::memory_order_relaxed), pOutputF32, m_pOutputFFTF32, m_pMixTempF32, frameCount);
+			pVoices->cursor[i].fetch_add(framesRead, std::memory_order_relaxed);
+			if (framesRead < frameCount) {
+				uint8_t playing = Sound::State::Playing;
+				pVoices->state[i].compare_exchange_strong(playing, Sound::State::Stopped);
 			}
 		}
 
-		// Calculate the BEAT
-		float instant = 0;	// Instant
-		float avg = 0;		// Average energy
-		
-		for (uint32_t i = 0; i < FFT_SIZE; i++)
-			instant += m_pFFTBuffer[i]/2.0f;
-		
-		// calculate average energy in last samples
-		for (uint32_t i = 0; i < FFT_SIZE; i++) {
-			avg += m_pEnergy[i];
-		}
-		avg /= (float)m_iPosition;
+		// Fill the sampleBuffer for the FFT analysis
+		if (m_pOutputAnalyzer)
+			m_pOutputAnalyzer->captureSamples(m_pOutputFFTF32, CHANNEL_COUNT, frameCount);
+	}
 
-		// instant sample is a beat?
-		if ((instant / avg) > m_fBeatRatio) {
-			m_fIntensity = 1.0f;
-		}
-		else if (m_fIntensity > 0) {
-			m_fIntensity -= m_fFadeOut * frameTime;
-			if (m_fIntensity < 0) m_fIntensity = 0;
+	void SoundManager::checkXrun(ma_device* pDevice, ma_uint32 frameCount, std::chrono::steady_clock::time_point callbackStart)
+	{
+		using namespace std::chrono;
+
+		// The first callback after a start has no reference
+		if (m_resetTiming.exchange(false, std::memory_order_relaxed)) {
+			m_lastCallback = callbackStart;
+			return;
 		}
 
-		// updated kernel shared variable
-		// to be used by kernel itself or another sections
-		m_fBeat += m_fIntensity;
-		if (m_fBeat > 1.0)
-			m_fBeat = 1.0f;
+		// Two ways to run dry: the callback came later than the whole device buffer lasts,
+		// or rendering took longer than the period it had to fill
+		bool isPlayback = pDevice->type != ma_device_type_capture;
+		ma_uint32 periodSize = isPlayback ? pDevice->playback.internalPeriodSizeInFrames : pDevice->capture.internalPeriodSizeInFrames;
+		ma_uint32 periods = isPlayback ? pDevice->playback.internalPeriods : pDevice->capture.internalPeriods;
+		float sampleRate = static_cast<float>(pDevice->sampleRate);
+		float bufferTime = periodSize * (periods ? periods : 1) / sampleRate;
+		float periodTime = frameCount / sampleRate;
+
+		float gap = duration<float>(callbackStart - m_lastCallback).count();
+		float renderTime = duration<float>(steady_clock::now() - callbackStart).count();
+		if (gap > bufferTime + periodTime || renderTime > periodTime)
+			m_xrunCount.fetch_add(1, std::memory_order_relaxed);
+		m_lastCallback = callbackStart;
+	}
 
-		// update energy buffer
-		if (m_iPosition < FFT_SIZE) {
-			m_pEnergy[m_iPosition - 1] = instant;
-			m_iPosition++;
-		}
-		else {
-			for (uint32_t i = 1; i < FFT_SIZE; i++) {
-				m_pEnergy[i - 1] = m_pEnergy[i];
-			}
-			m_pEnergy[FFT_SIZE - 1] = instant;
+	bool SoundManager::performFFT(float frameTime)
+	{
+		if (!m_inited) {
+			return false;
 		}
 
+		if (m_pOutputAnalyzer)
+			m_pOutputAnalyzer->performFFT(frameTime);
+		if (m_pInputAnalyzer)
+			m_pInputAnalyzer->performFFT(frameTime);
+
 		return true;
 	}
 
+	SoundAnalyzer* SoundManager::getOutputAnalyzer()
+	{
+		return m_pOutputAnalyzer;
+	}
+
+	SoundAnalyzer* SoundManager::getInputAnalyzer()
+	{
+		return m_pInputAnalyzer;
+	}
+
 }
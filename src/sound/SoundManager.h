@@ -3,90 +3,204 @@
 
 #pragma once
 
+#include <algorithm>
 #include <string>
 #include <string_view>
 #include <vector>
 #include <memory>
-
-#include <kiss_fft.h>
-#include <kiss_fftr.h>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+#include <chrono>
 
 #include "sound/Sound.h"
+#include "sound/SoundAnalyzer.h"
+#include "sound/SoundLoader.h"
+#include "sound/SoundVoices.h"
 
 namespace Phoenix {
 
-	#define FFT_SIZE 1024
 	#define CHANNEL_COUNT 2
 	#define SAMPLE_RATE 44100
 	#define SAMPLE_FORMAT ma_format_f32
 	#define SAMPLE_STORAGE	4096 // Sample storage size (4096 float samples)
 
+	// Device types
+	enum class DeviceMode {
+		Playback = 0,	// Play our sounds
+		Capture,		// Analyze a capture device (line-in, DJ feed...), nothing is played
+		Duplex,			// Play our sounds and analyze a capture device
+	};
+
+	// Sources sent to the analyzers
+	enum class AnalysisSource {
+		Output = 0,		// Our mix
+		Input,			// The capture device
+		Both,			// Both, each one with its own analyzer
+	};
+
+	// Device performance profile
+	enum class LatencyMode {
+		Default = 0,	// Backend defaults
+		LowLatency,		// Small buffers, for live input and tight sync
+		Conservative,	// Bigger buffers, for stability
+	};
+
+	struct SoundDeviceConfig {
+		DeviceMode		mode = DeviceMode::Playback;
+		AnalysisSource	analysis = AnalysisSource::Output;
+		LatencyMode		latency = LatencyMode::Default;
+		uint32_t		periodSizeInFrames = 0;		// Period size (0: backend default)
+		uint32_t		periods = 0;				// Periods in the device buffer (0: backend default)
+		bool			adaptiveLatency = false;	// Grow or shrink the period from the xrun history, see updateLatency()
+		uint32_t		minPeriodSizeInFrames = 64;		// Limits of the adaptive controller
+		uint32_t		maxPeriodSizeInFrames = 8192;
+	};
+
+	// Latency achieved by the device
+	struct SoundLatencyInfo {
+		uint32_t		periodSizeInFrames = 0;
+		uint32_t		periods = 0;
+		float			playbackMs = 0.0f;			// Playback buffer
+		float			captureMs = 0.0f;			// Capture buffer
+		float			totalMs = 0.0f;				// End to end: input to output in duplex mode, the buffer of the device otherwise
+		uint32_t		xruns = 0;					// Detected xruns since the device was created
+	};
+
+	using SoundFuture = std::shared_future<SoundHandle>;	// Result of an asynchronous load, invalid handle if the sound could not be loaded
+	using SoundProgressCallback = std::function<void(uint32_t loaded, uint32_t total, const std::string& filePath, bool ok)>; // Called from the loading threads
+
 	class SoundManager final {
 
 	public:
-		SoundManager();
+		SoundManager(const SoundDeviceConfig& config = SoundDeviceConfig());
 		~SoundManager();
 
 	public:
 		bool setMasterVolume(float volume);
-		SP_Sound addSound(const std::string_view filePath);
-		SP_Sound getSoundbyID(uint32_t id);
+		SoundHandle addSound(const std::string_view filePath);	// Blocks until the sound is loaded
+		SoundFuture addSoundAsync(const std::string_view filePath);	// The sound is loaded in the background and published once it is ready
+		std::vector<SoundFuture> preloadSounds(const std::vector<std::string>& filePaths, SoundProgressCallback progress = nullptr);
+		std::vector<SoundFuture> preloadManifest(const std::string_view manifestFile, SoundProgressCallback progress = nullptr); // Text file, one sound per line ('#' for comments)
+		void waitLoads();	// Wait until all the pending loads are finished
+		bool openPack(const std::string_view packFile);	// Sounds found in the pack are loaded from it instead of from disk
+		void closePack();	// Also clears all the sounds, since they may point into the pack
+		SoundHandle findSound(const std::string_view filePath);	// Invalid handle if the sound is not loaded
+		SP_Sound getSound(SoundHandle handle);					// nullptr if the handle is no longer valid
+		uint32_t getSoundCount();
 		void clearSounds();
+
+		bool playSound(SoundHandle handle);
+		bool stopSound(SoundHandle handle);
+		bool restartSound(SoundHandle handle);
+		bool seekSound(SoundHandle handle, float second);
+		bool setSoundVolume(SoundHandle handle, float volume);
+		Sound::State getSoundState(SoundHandle handle);
+		float getSoundPosition(SoundHandle handle);				// Playback position, in seconds
+
 		std::string getVersion();
 
 		void playDevice();
 		void stopDevice();
 
-		void enumerateDevices();
+		// The device lists are cached. Changes are only detected when the open device is rerouted (e.g. the default
+		// device changed): devices plugged or unplugged elsewhere are seen after enumerateDevices() or refreshDevices()
+		void enumerateDevices();	// Refresh and print the device lists
+		bool refreshDevices();		// Enumerate the devices again, returns true if the lists changed
+		bool updateDevices(bool force = false);	// Refresh the cached device lists if they may have changed, returns true if they did
+		const std::vector<ma_device_info>& getPlaybackDevices();
+		const std::vector<ma_device_info>& getCaptureDevices();
+		void setDeviceListCallback(std::function<void()> callback);	// Called when the cached device lists change
+		bool switchDevice(int32_t playbackDevice, int32_t captureDevice, uint32_t sampleRate = 0); // Hot-swap the device, keeping the sounds and analysis (-1: default device, 0: keep sample rate). Sounds are converted to a new rate before the swap, the gap is only the device stop and start
+
+		SoundLatencyInfo getLatencyInfo();
+		bool updateLatency();	// Adaptive latency controller, call it regularly from the main thread. Returns true if the period changed
 
 	private:
-		static ma_uint32 read_and_mix_pcm_frames_f32(ma_decoder* pDecoder, float volume, float* pOutputF32, float* pOutputFFTF32, ma_uint32 frameCount);
+		static ma_uint32 read_and_mix_pcm_frames_f32(ma_data_source* pDataSource, float volume, float* pOutputF32, float* pOutputFFTF32, float* pTempF32, ma_uint32 frameCount);
 		static void dataCallback (ma_device* pDevice, void* pOutput, const void* pInput, ma_uint32 frameCount);
+		void mixBlock(float* pOutputF32, ma_uint32 frameCount);
+		void checkXrun(ma_device* pDevice, ma_uint32 frameCount, std::chrono::steady_clock::time_point callbackStart);
+		static void notificationCallback(const ma_device_notification* pNotification);
+		ma_device* createDevice(const ma_device_id* pPlaybackID, const ma_device_id* pCaptureID, uint32_t sampleRate);
 		void destroyDevice();
+		bool recreateDevice(const ma_device_id* pPlaybackID, const ma_device_id* pCaptureID, uint32_t sampleRate);
+		SoundFuture loadAsync(const std::string_view filePath, const SoundLoadConfig& config, std::function<void(bool ok)> onDone);
+		SoundHandle publishSound(SP_Sound newSound, const std::string& path);
+		bool isValid(SoundHandle handle);
+		void waitMixer();
 	
 	public:
 		bool performFFT(float currentTime);
+		SoundAnalyzer* getOutputAnalyzer();	// nullptr if the output is not analyzed
+		SoundAnalyzer* getInputAnalyzer();	// nullptr if the input is not analyzed
 
 	private:
-		ma_device*		m_pDevice;		// Internal miniaudio device for playback
+		ma_context*		m_pContext;		// Internal miniaudio context, shared by the enumeration and the devices
+		ma_device*		m_pDevice;		// Internal miniaudio device (playback, capture or duplex)
 		ma_event		m_stopEvent;	// Signaled by the audio thread, waited on by the main thread.
 
 		int32_t			m_LoadedSounds; // Loaded sounds
 		bool			m_inited;
 
+		SoundDeviceConfig	m_deviceConfig;
+
+		// Cached device lists
+		std::vector<ma_device_info>	m_playbackDevices;
+		std::vector<ma_device_info>	m_captureDevices;
+		std::atomic<bool>	m_devicesDirty;		// Set when the backend reports a change, the lists are refreshed on the next update
+		std::function<void()>	m_deviceListCallback;
+
+		// Current device, -1: default device
+		ma_device_id	m_playbackID;
+		ma_device_id	m_captureID;
+		bool			m_defaultPlayback = true;
+		bool			m_defaultCapture = true;
+
+		// Xrun detection and adaptive latency
+		std::atomic<uint32_t>	m_xrunCount;
+		std::atomic<bool>	m_resetTiming;				// Set when the device (re)starts, so the gap is not taken as an xrun
+		std::chrono::steady_clock::time_point	m_lastCallback;	// Audio thread only
+		uint32_t		m_lastXrunCount = 0;
+		uint32_t		m_adaptFloor = 0;			// Periods below this value caused xruns, not retried until a long clean run
+		bool			m_adaptCantGrow = false;	// The backend ignored our period request, don't reopen the device for nothing
+		bool			m_adaptCantShrink = false;
+		std::chrono::steady_clock::time_point	m_lastXrunTime;
+		std::chrono::steady_clock::time_point	m_lastAdaptTime;
+
 		uint32_t		m_channels;
 		uint32_t		m_sampleRate;
 	
-		// FFT capture and analysis
-		kiss_fftr_cfg	m_fftcfg;
-		float*			m_pSampleBuf;				// Sample buffer used to capture Buffer values, to be sent to the FFT analyzer, Size is: (FFT_SIZE * 2)
-		float			m_fAmplification = 1.0f;
+		// FFT capture and analysis, one analyzer per source
+		SoundAnalyzer*	m_pOutputAnalyzer;			// Analysis of our mix
+		SoundAnalyzer*	m_pInputAnalyzer;			// Analysis of the capture device
 		float*			m_pOutputFFTF32;			// Buffer for storing the output samples, removing the impacts of the volume control, size is: SAMPLE_STORAGE
-		
-		// Group magnitudes into low, mid, and high frequency bands
-		float			m_lowFreqMax = 400.0f;		// Low frequency max value: Adjustable parameter
-		float			m_midFreqMax = 2000.0f;		// Mid frequency max value: Adjustable parameter
-
-		// BEAT detection
-		float*			m_pEnergy;					// Energy buffer
-		uint32_t		m_iPosition = 1;			// Position
-		float			m_fIntensity = 0;			// Intensity
-	public:
-		float			m_fBeatRatio = 1.4f;		// Beat Ratio: Adjustable parameter
-		float			m_fFadeOut = 4.0f;			// Fade Out: Adjustable parameter
-		float			m_fBeat = 0;				// Beat detection (0 to 1)
+		float*			m_pMixTempF32;				// Scratch buffer for the mixer, size is: SAMPLE_STORAGE
 
-		
-	private:
-		float*			m_pFFTFrequencies;		// FFT frequencies analyzed, size is: FFT_SIZE
 	public:
-		float*			m_pFFTBuffer;			// FFT magnitues, size is: FFT_SIZE
-		float			m_fLowFreqSum = 0.0f;
-		float			m_fMidFreqSum = 0.0f;
-		float			m_fHighFreqSum = 0.0f;
+		SoundLoadConfig	m_loadConfig;			// Load-time conversion settings: Adjustable parameter
 
-	public:
-		std::vector<SP_Sound>	sound; // Sound list
+	private:
+		SoundLoader*	m_pLoader;						// Worker pool for the asynchronous loads
+		SoundPack*		m_pPack;						// Opened pack (nullptr if none), protected by m_soundMutex
+		bool			m_packClosing = false;			// New loads are refused while the pack is being closed
+		struct PendingLoad {
+			SoundFuture		future;
+			std::vector<std::function<void(bool ok)>>	callbacks;	// Extra requests for the same file, called by the load job
+		};
+		std::unordered_map<std::string, PendingLoad>	m_pendingLoads;	// Loads in progress, by file path
+		std::mutex		m_soundMutex;					// Protects the handle table (never taken by the mixer)
+
+		// Handle table: slots are reused, each reuse bumps the slot generation
+		SP_Sound		m_sounds[MAX_SOUNDS];			// Loaded sounds, by slot
+		uint32_t		m_generations[MAX_SOUNDS];		// Current generation of each slot
+		std::vector<uint32_t>	m_freeSlots;			// Slots available for new sounds
+		std::unordered_map<std::string, SoundHandle>	m_soundsByPath;	// Loaded sounds, by file path
+
+		SoundVoices*	m_pVoices;						// Voice state read by the mixer
+		std::atomic<uint64_t>	m_mixerEpoch;			// Incremented when the mixer enters and leaves the callback (odd while mixing)
 
 	};
 }
@@ -0,0 +1,267 @@
+// SoundPack.cpp
+// Spontz Demogroup
+
+#include "main.h"
+#include "sound/SoundPack.h"
+
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+namespace Phoenix {
+
+	#define PACK_VERSION	1
+	#define PACK_ALIGNMENT	64	// Alignment of the data blocks inside the pack
+
+	// Pack layout: header, data blocks (original files and PCM), names, entry table
+	struct PackHeader {
+		char		magic[8];		// "PHXPACK"
+		uint32_t	version;
+		uint32_t	entryCount;
+		uint64_t	entriesOffset;
+		uint64_t	namesOffset;
+	};
+
+	struct PackEntry {
+		uint64_t	nameOffset;		// From namesOffset
+		uint64_t	nameLength;
+		uint64_t	dataOffset;
+		uint64_t	dataSize;
+		uint64_t	dataHash;
+		uint64_t	pcmOffset;		// 0 if there is no PCM
+		uint64_t	pcmFrames;
+		uint32_t	pcmChannels;
+		uint32_t	pcmSampleRate;
+	};
+
+	SoundPack::SoundPack()
+		:
+		m_pData(nullptr),
+		m_size(0),
+		m_hFile(nullptr),
+		m_hMapping(nullptr)
+	{
+	}
+
+	SoundPack::~SoundPack()
+	{
+		close();
+	}
+
+	bool SoundPack::open(const std::string_view packFile)
+	{
+		close();
+
+#ifdef _WIN32
+		HANDLE hFile = CreateFileA(std::string(packFile).c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+		if (hFile == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER fileSize;
+		HANDLE hMapping = NULL;
+		if (GetFileSizeEx(hFile, &fileSize) && fileSize.QuadPart > 0)
+			hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (hMapping == NULL) {
+			CloseHandle(hFile);
+			return false;
+		}
+		m_pData = (const uint8_t*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+		if (m_pData == nullptr) {
+			CloseHandle(hMapping);
+			CloseHandle(hFile);
+			return false;
+		}
+		m_hFile = hFile;
+		m_hMapping = hMapping;
+		m_size = static_cast<uint64_t>(fileSize.QuadPart);
+#else
+		int fd = ::open(std::string(packFile).c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat fileStat;
+		if (fstat(fd, &fileStat) != 0 || fileStat.st_size <= 0) {
+			::close(fd);
+			return false;
+		}
+		void* pMap = mmap(NULL, static_cast<size_t>(fileStat.st_size), PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd); // The mapping keeps the file alive
+		if (pMap == MAP_FAILED)
+			return false;
+		m_pData = (const uint8_t*)pMap;
+		m_size = static_cast<uint64_t>(fileStat.st_size);
+#endif
+
+		// Check the header and build the index, only the header and the tables are paged in here
+		const PackHeader* pHeader = (const PackHeader*)m_pData;
+		if (m_size < sizeof(PackHeader) ||
+			memcmp(pHeader->magic, "PHXPACK", 8) != 0 ||
+			pHeader->version != PACK_VERSION ||
+			pHeader->entriesOffset > m_size ||
+			pHeader->namesOffset > pHeader->entriesOffset ||
+			(m_size - pHeader->entriesOffset) / sizeof(PackEntry) < pHeader->entryCount) {
+			close();
+			return false;
+		}
+
+		const PackEntry* pEntries = (const PackEntry*)(m_pData + pHeader->entriesOffset);
+		const char* pNames = (const char*)(m_pData + pHeader->namesOffset);
+		uint64_t namesSize = pHeader->entriesOffset - pHeader->namesOffset;
+		for (uint32_t i = 0; i < pHeader->entryCount; i++) {
+			const PackEntry& entry = pEntries[i];
+			uint64_t pcmSize = entry.pcmFrames * entry.pcmChannels * sizeof(float);
+			if (entry.nameOffset + entry.nameLength > namesSize ||
+				entry.dataOffset + entry.dataSize > m_size ||
+				(entry.pcmOffset && entry.pcmOffset + pcmSize > m_size)) {
+				close();
+				return false;
+			}
+
+			SoundPackAsset asset;
+			asset.name = std::string_view(pNames + entry.nameOffset, static_cast<size_t>(entry.nameLength));
+			asset.pData = m_pData + entry.dataOffset;
+			asset.dataSize = static_cast<size_t>(entry.dataSize);
+			asset.dataHash = entry.dataHash;
+			if (entry.pcmOffset) {
+				asset.pPCM = (const float*)(m_pData + entry.pcmOffset);
+				asset.pcmFrames = entry.pcmFrames;
+				asset.pcmChannels = entry.pcmChannels;
+				asset.pcmSampleRate = entry.pcmSampleRate;
+			}
+			m_assets[std::string(asset.name)] = asset;
+		}
+
+		return true;
+	}
+
+	void SoundPack::close()
+	{
+		m_assets.clear();
+		if (m_pData == nullptr)
+			return;
+
+#ifdef _WIN32
+		UnmapViewOfFile(m_pData);
+		CloseHandle((HANDLE)m_hMapping);
+		CloseHandle((HANDLE)m_hFile);
+#else
+		munmap((void*)m_pData, static_cast<size_t>(m_size));
+#endif
+		m_pData = nullptr;
+		m_size = 0;
+		m_hFile = nullptr;
+		m_hMapping = nullptr;
+	}
+
+	bool SoundPack::findAsset(const std::string_view name, SoundPackAsset& asset)
+	{
+		auto found = m_assets.find(normalizeName(name));
+		if (found == m_assets.end())
+			return false;
+		asset = found->second;
+		return true;
+	}
+
+	uint32_t SoundPack::getAssetCount()
+	{
+		return static_cast<uint32_t>(m_assets.size());
+	}
+
+	bool SoundPack::build(const std::string_view packFile, const std::vector<std::string>& files, uint32_t pcmChannels, uint32_t pcmSampleRate, const SoundLoadConfig& config)
+	{
+		FILE* pFile = fopen(std::string(packFile).c_str(), "wb");
+		if (pFile == nullptr)
+			return false;
+
+		std::vector<PackEntry> entries;
+		std::string names;
+		uint64_t offset = 0;
+		bool ok = true;
+
+		auto write = [&](const void* pData, size_t size) {
+			if (ok && size > 0 && fwrite(pData, 1, size, pFile) != size)
+				ok = false;
+			offset += size;
+		};
+		auto align = [&]() {
+			static const uint8_t zeros[PACK_ALIGNMENT] = { 0 };
+			write(zeros, static_cast<size_t>((PACK_ALIGNMENT - offset % PACK_ALIGNMENT) % PACK_ALIGNMENT));
+		};
+
+		// The header is written again at the end, once the offsets are known
+		PackHeader header;
+		memset(&header, 0, sizeof(header));
+		write(&header, sizeof(header));
+
+		for (auto const& file : files) {
+			std::vector<uint8_t> data;
+			if (!SoundConverter::readFile(file, data)) {
+				printf("Could not read file: %s\n", file.c_str());
+				ok = false;
+				break;
+			}
+
+			PackEntry entry;
+			memset(&entry, 0, sizeof(entry));
+			std::string name = normalizeName(file);
+			entry.nameOffset = names.size();
+			entry.nameLength = name.size();
+			names += name;
+
+			align();
+			entry.dataOffset = offset;
+			entry.dataSize = data.size();
+			entry.dataHash = SoundConverter::hash(data.data(), data.size());
+			write(data.data(), data.size());
+
+			if (pcmSampleRate) {
+				std::vector<float> pcm;
+				if (!SoundConverter::convertToPCM(data.data(), data.size(), pcmChannels, pcmSampleRate, config, pcm)) {
+					printf("Could not decode file: %s\n", file.c_str());
+					ok = false;
+					break;
+				}
+				align();
+				entry.pcmOffset = offset;
+				entry.pcmFrames = pcm.size() / pcmChannels;
+				entry.pcmChannels = pcmChannels;
+				entry.pcmSampleRate = pcmSampleRate;
+				write(pcm.data(), pcm.size() * sizeof(float));
+			}
+
+			entries.push_back(entry);
+		}
+
+		header.namesOffset = offset;
+		write(names.data(), names.size());
+		align();
+		header.entriesOffset = offset;
+		write(entries.data(), entries.size() * sizeof(PackEntry));
+
+		memcpy(header.magic, "PHXPACK", 8);
+		header.version = PACK_VERSION;
+		header.entryCount = static_cast<uint32_t>(entries.size());
+		if (ok && (fseek(pFile, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, pFile) != 1))
+			ok = false;
+
+		fclose(pFile);
+		if (!ok)
+			remove(std::string(packFile).c_str());
+		return ok;
+	}
+
+	std::string SoundPack::normalizeName(const std::string_view name)
+	{
+		std::string normalized(name);
+		for (auto& c : normalized) {
+			if (c == '\\')
+				c = '/';
+		}
+		return normalized;
+	}
+}
@@ -0,0 +1,54 @@
+// SoundPack.h
+// Spontz Demogroup
+
+#pragma once
+
+#include "main.h"
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "sound/SoundConverter.h"
+
+namespace Phoenix {
+
+	// A sound stored in a pack, pointing straight into the mapped file
+	struct SoundPackAsset {
+		std::string_view	name;				// Original file path, used to find the asset
+		const void*			pData = nullptr;	// Original (compressed) file data
+		size_t				dataSize = 0;
+		uint64_t			dataHash = 0;		// Hash of the original data, used as the PCM cache key
+		const float*		pPCM = nullptr;		// Pre-decoded PCM (nullptr if not stored in the pack)
+		uint64_t			pcmFrames = 0;
+		uint32_t			pcmChannels = 0;
+		uint32_t			pcmSampleRate = 0;
+	};
+
+	// Read-only archive with all the sounds of a production, memory mapped: one open, data paged in on demand
+	class SoundPack final {
+
+	public:
+		SoundPack();
+		~SoundPack();
+
+	public:
+		bool open(const std::string_view packFile);
+		void close();
+		bool findAsset(const std::string_view name, SoundPackAsset& asset);	// Thread safe once opened
+		uint32_t getAssetCount();
+
+		// Builds a pack, optionally with the sounds pre-decoded to PCM (pcmSampleRate 0: no PCM)
+		static bool build(const std::string_view packFile, const std::vector<std::string>& files, uint32_t pcmChannels, uint32_t pcmSampleRate, const SoundLoadConfig& config);
+
+		static std::string normalizeName(const std::string_view name);	// Name used to find a sound, also the key of the loaded sounds
+
+	private:
+		const uint8_t*	m_pData;		// Mapped file
+		uint64_t		m_size;
+		void*			m_hFile;		// Platform handles of the mapping
+		void*			m_hMapping;
+		std::unordered_map<std::string, SoundPackAsset>	m_assets;	// Index, by normalized name
+	};
+}
@@ -0,0 +1,34 @@
+// SoundVoices.h
+// Spontz Demogroup
+
+#pragma once
+
+#include "main.h"
+
+#include <atomic>
+
+namespace Phoenix {
+
+	#define MAX_SOUNDS 256	// Maximum number of sounds loaded at the same time
+	#define NO_SEEK UINT64_MAX
+
+	// Generational handle to a loaded sound: the generation changes each time a slot is reused, so old handles become invalid
+	struct SoundHandle {
+		uint32_t	index = UINT32_MAX;
+		uint32_t	generation = 0;
+
+		bool isValid() const { return index != UINT32_MAX; }
+		bool operator==(const SoundHandle& other) const { return index == other.index && generation == other.generation; }
+	};
+
+	// Per-voice hot state, as a structure of arrays indexed by the handle slot, so the mixer scans each field linearly.
+	// Arrays have a fixed size and never move: the mixer reads them without locks, a voice is published by storing its state last.
+	struct SoundVoices {
+		std::atomic<uint8_t>		state[MAX_SOUNDS];		// Sound::State
+		std::atomic<float>			gain[MAX_SOUNDS];		// Sound volume (0.0 to 1.0)
+		std::atomic<uint64_t>		cursor[MAX_SOUNDS];		// Playback position, in frames
+		std::atomic<uint64_t>		seek[MAX_SOUNDS];		// Seek requested by the main thread, applied by the mixer (NO_SEEK: none)
+		ma_data_source*				source[MAX_SOUNDS];		// Data source to read from
+		std::atomic<uint32_t>		count;					// Slots in use are all below this value
+	};
+}
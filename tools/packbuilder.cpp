@@ -0,0 +1,64 @@
+// packbuilder.cpp
+// Spontz Demogroup
+//
+// Builds a sound pack with all the audio files of a production
+// Usage: packbuilder <pack file> [-pcm <channels> <sample rate>] [-manifest <manifest file>] [files...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define PHOENIX_MAIN
+#include "main.h"
+
+#include "sound/SoundPack.h"
+
+using namespace Phoenix;
+
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3) {
+		printf("Usage: %s <pack file> [-pcm <channels> <sample rate>] [-manifest <manifest file>] [files...]\n", argv[0]);
+		printf("    -pcm       Also store the sounds pre-decoded to PCM, e.g: -pcm 2 44100\n");
+		printf("    -manifest  Add the files listed in a manifest (one file per line, '#' for comments)\n");
+		return 1;
+	}
+
+	std::vector<std::string> files;
+	uint32_t pcmChannels = 0;
+	uint32_t pcmSampleRate = 0;
+
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "-pcm") == 0 && i + 2 < argc) {
+			pcmChannels = static_cast<uint32_t>(atoi(argv[++i]));
+			pcmSampleRate = static_cast<uint32_t>(atoi(argv[++i]));
+		}
+		else if (strcmp(argv[i], "-manifest") == 0 && i + 1 < argc) {
+			if (!SoundConverter::readManifest(argv[++i], files)) {
+				printf("Could not read manifest: %s\n", argv[i]);
+				return 1;
+			}
+		}
+		else {
+			files.push_back(argv[i]);
+		}
+	}
+
+	if (files.empty() || (pcmSampleRate && pcmChannels == 0)) {
+		printf("Nothing to pack\n");
+		return 1;
+	}
+
+	SoundLoadConfig config;
+	config.quality = ResampleQuality::High; // Done once, offline
+	if (!SoundPack::build(argv[1], files, pcmChannels, pcmSampleRate, config)) {
+		printf("Error building pack: %s\n", argv[1]);
+		return 1;
+	}
+
+	printf("Pack %s built with %u files\n", argv[1], static_cast<uint32_t>(files.size()));
+	return 0;
+}